@@ -4,8 +4,202 @@
 #include <SFML/Graphics.hpp>
 #include <cmath>
 #include <set>
+#include <future>
+#include <optional>
+#include <unordered_map>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <filesystem>
+#include <random>
+#include <chrono>
+#include <functional>
+#include <cstdlib>
+#include <new>
+#include <cstdint>
+#include <coroutine>
+#include <memory>
+#include <array>
+#include <tuple>
+#include <string_view>
+#include <limits>
+#include <span>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+
+
+// Which part of the game an allocation is charged to. Set with AllocScope
+enum class ALLOC_SCOPE {OTHER=0, PLAYER, ENEMIES, BULLETS, DAMAGE, ROLLBACK, ROOMS, RENDER, BACKGROUND, COUNT};
+
+// Counts every heap allocation (through the global operator new below), per ALLOC_SCOPE,
+// so we can see what allocates each frame and get it down to zero
+class AllocTracker
+{
+public:
+    static const int SCOPES = static_cast<int>(ALLOC_SCOPE::COUNT);
+
+    static inline std::atomic<long long> counts[SCOPES];
+    static inline std::atomic<long long> bytes[SCOPES];
+    static inline std::atomic<long long> frees;
+    static inline thread_local ALLOC_SCOPE currentScope = ALLOC_SCOPE::OTHER;
+    static inline thread_local long long threadCount = 0; // Everything this thread allocated, whatever the scope
+
+    // Results of the last finished frame
+    static inline long long frameCounts[SCOPES];
+    static inline long long frameBytes[SCOPES];
+    static inline long long frameFrees = 0; // All threads, frees aren't charged to a scope
+    static inline long long frameIndex = 0;
+
+    // If > 0, every frame after this many must not allocate on the main thread, or the game exits with an error
+    static inline long long guardAfterFrames = 0;
+    static inline long long frameMainThread = 0; // Last frame's allocations on the thread that calls BeginFrame/EndFrame
+
+    static void Record(size_t size)
+    {
+        threadCount++;
+        int s = static_cast<int>(currentScope);
+        counts[s].fetch_add(1, std::memory_order_relaxed);
+        bytes[s].fetch_add((long long)size, std::memory_order_relaxed);
+    }
+
+    static const char* ScopeName(int s)
+    {
+        static const char* names[SCOPES] = { "other", "player", "enemies", "bullets", "damage", "rollback", "rooms", "render", "background" };
+        return names[s];
+    }
+
+    // BeginFrame and EndFrame have to be called from the main thread
+    static void BeginFrame()
+    {
+        startMainThread = threadCount;
+        startFrees = frees.load(std::memory_order_relaxed);
+        for (int i = 0; i < SCOPES; i++)
+        {
+            startCounts[i] = counts[i].load(std::memory_order_relaxed);
+            startBytes[i] = bytes[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    static void EndFrame()
+    {
+        // The per scope counts include other threads (the render thread, loaders), so the guard only
+        // looks at what this thread allocated
+        frameMainThread = threadCount - startMainThread;
+        frameFrees = frees.load(std::memory_order_relaxed) - startFrees;
+        for (int i = 0; i < SCOPES; i++)
+        {
+            frameCounts[i] = counts[i].load(std::memory_order_relaxed) - startCounts[i];
+            frameBytes[i] = bytes[i].load(std::memory_order_relaxed) - startBytes[i];
+        }
+        frameIndex++;
+
+        if (guardAfterFrames > 0 && frameIndex > guardAfterFrames && frameMainThread > 0)
+        {
+            std::cout << "[ALLOC]: frame " << frameIndex << " allocated in steady state\n";
+            Report();
+            std::exit(1);
+        }
+    }
+
+    // Prints the last frame's allocations per scope
+    static void Report()
+    {
+        std::cout << "[ALLOC]: frame " << frameIndex << ", " << frameMainThread << " on the main thread, " << frameFrees << " frees\n";
+        for (int i = 0; i < SCOPES; i++)
+        {
+            if (frameCounts[i] == 0) continue;
+            std::cout << "  " << ScopeName(i) << ": " << frameCounts[i] << " allocations, " << frameBytes[i] << " bytes\n";
+        }
+    }
+
+private:
+    static inline long long startCounts[SCOPES];
+    static inline long long startBytes[SCOPES];
+    static inline long long startMainThread = 0;
+    static inline long long startFrees = 0;
+};
 
+// Charges every allocation on this thread to scope until it goes out of scope
+struct AllocScope
+{
+    ALLOC_SCOPE previous;
+
+    AllocScope(ALLOC_SCOPE scope)
+    {
+        previous = AllocTracker::currentScope;
+        AllocTracker::currentScope = scope;
+    }
+    ~AllocScope()
+    {
+        AllocTracker::currentScope = previous;
+    }
+};
+
+void* operator new(size_t size)
+{
+    AllocTracker::Record(size);
+    if (void* p = std::malloc(size == 0 ? 1 : size)) return p;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size)
+{
+    AllocTracker::Record(size);
+    if (void* p = std::malloc(size == 0 ? 1 : size)) return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept
+{
+    if (p != nullptr) AllocTracker::frees.fetch_add(1, std::memory_order_relaxed);
+    std::free(p);
+}
+void operator delete[](void* p) noexcept
+{
+    if (p != nullptr) AllocTracker::frees.fetch_add(1, std::memory_order_relaxed);
+    std::free(p);
+}
+void operator delete(void* p, size_t) noexcept { operator delete(p); }
+void operator delete[](void* p, size_t) noexcept { operator delete[](p); }
 
+// Over-aligned types (alignas bigger than the default) come through these instead
+static void* AlignedAlloc(size_t size, std::align_val_t align)
+{
+    AllocTracker::Record(size);
+    size_t alignment = static_cast<size_t>(align);
+#ifdef _WIN32
+    void* p = _aligned_malloc(size == 0 ? 1 : size, alignment);
+#else
+    // aligned_alloc wants the size to be a multiple of the alignment
+    void* p = std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment + (size == 0 ? alignment : 0));
+#endif
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+static void AlignedFree(void* p)
+{
+    if (p != nullptr) AllocTracker::frees.fetch_add(1, std::memory_order_relaxed);
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    std::free(p);
+#endif
+}
+void* operator new(size_t size, std::align_val_t align) { return AlignedAlloc(size, align); }
+void* operator new[](size_t size, std::align_val_t align) { return AlignedAlloc(size, align); }
+void operator delete(void* p, std::align_val_t) noexcept { AlignedFree(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { AlignedFree(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { AlignedFree(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { AlignedFree(p); }
 
 enum class GAMETAG {PLAYER, BULLET, ENEMY};
 enum class COLLISIONBOXORIGIN {TOPLEFT, CENTER};
@@ -14,9 +208,21 @@ enum class COLLISIONTYPE {BOX, POINT, CIRCLE, NONE};
 enum class WORLD_GROUP {PLAYER=0, ENEMY=1, WALL=2, BULLET=3, OTHER=4};
 const int SCREEN_WIDTH = 800;
 const int SCREEN_HEIGHT = 600;
+// Size of one grid partition. Rooms of any size get split into cells of roughly this size
+const int GRID_CELL_WIDTH = 400;
+const int GRID_CELL_HEIGHT = 300;
 
-// If true, bullets will damage ALL gamaeobjects they hit instead of just the first one
-const bool BULLETS_DAMAGE_ALL = false;
+// Simulation runs in fixed ticks so it is deterministic and can be rolled back and replayed
+const float TICK_DT = 1.0f / 60.0f;
+const int MAX_TICKS_PER_FRAME = 5; // Stops the game from spiralling if a frame takes very long
+const int MAX_ROLLBACK_FRAMES = 8;
+const int MAX_PLAYERS = 2;
+
+// Adds a second player driven by a scripted bot whose inputs arrive through a fake network with this
+// much latency/jitter. For testing rollback without a real connection
+const bool LOOPBACK_COOP_TEST = false;
+const float LOOPBACK_LATENCY = 0.08f; // Seconds
+const float LOOPBACK_JITTER = 0.03f; // Seconds, +/-
 
 
 sf::RenderWindow* window;
@@ -28,11 +234,473 @@ static struct Keybindings
 {
     const static sf::Keyboard::Key STRAFE = sf::Keyboard::Key::LShift;
     const static sf::Keyboard::Key FIRE = sf::Keyboard::Key::C;
+    const static sf::Keyboard::Key MEASURE_ROLLBACK = sf::Keyboard::Key::F2;
+    const static sf::Keyboard::Key TOGGLE_HIT_POLICY = sf::Keyboard::Key::F3;
+    const static sf::Keyboard::Key ALLOC_REPORT = sf::Keyboard::Key::F4;
+    const static sf::Keyboard::Key PIPELINE_REPORT = sf::Keyboard::Key::F5;
+    const static sf::Keyboard::Key TOGGLE_HOMING = sf::Keyboard::Key::F6;
+    const static sf::Keyboard::Key FRAME_REPORT = sf::Keyboard::Key::F7;
+    const static sf::Keyboard::Key BROADPHASE_REPORT = sf::Keyboard::Key::F8;
+    const static sf::Keyboard::Key GRID_REPORT = sf::Keyboard::Key::F9;
+};
+
+// Everything a player can do in one tick. Small so it is cheap to store and send over the network
+struct PlayerInput
+{
+    signed char x = 0; // -1, 0, 1
+    signed char y = 0;
+    bool strafe = false;
+    bool fire = false;
+    // Rule switches (F6, F3). They go through the inputs so every player and every replay flips them on the same tick
+    bool toggleHoming = false;
+    bool toggleHitPolicy = false;
+
+    bool operator==(const PlayerInput& other) const
+    {
+        return x == other.x && y == other.y && strafe == other.strafe && fire == other.fire
+            && toggleHoming == other.toggleHoming && toggleHitPolicy == other.toggleHitPolicy;
+    }
+    bool operator!=(const PlayerInput& other) const { return !(*this == other); }
+};
+
+// Lightweight reference to a region of the texture atlas. Stays valid while the texture is loading,
+// it just points at the placeholder until then
+struct SpriteHandle
+{
+    int index = 0; // 0 = placeholder (plain white, tint it with a colour)
+};
+
+// Loads every texture once, in the background, and packs it into one big atlas texture so
+// everything can be drawn in a single batch. Textures live in assets/<name>.png
+class AssetCache
+{
+public:
+    static constexpr unsigned ATLAS_SIZE = 2048;
+    // Gap around every packed texture, filled with copies of its edge pixels so filtering or scaling a
+    // sprite never samples its neighbour
+    static constexpr unsigned PADDING = 1;
+
+    void Init()
+    {
+        if (!atlas.resize(sf::Vector2u{ ATLAS_SIZE, ATLAS_SIZE })) throw std::runtime_error("Could not create texture atlas");
+        // Placeholder is a small white block in the corner
+        atlas.update(sf::Image(sf::Vector2u{ 4, 4 }, sf::Color::White), sf::Vector2u{ 0, 0 });
+        rects.clear();
+        loaded.clear();
+        rects.push_back(sf::IntRect({ 1, 1 }, { 2, 2 }));
+        loaded.push_back(true);
+        shelfX = 4;
+        shelfY = 0;
+        shelfHeight = 4;
+    }
+
+    // Returns a handle straight away. The file is only read the first time a name is requested
+    SpriteHandle Request(const std::string& name)
+    {
+        // Headless runs never call Init, everything just gets the placeholder
+        if (rects.empty()) return SpriteHandle{};
+
+        auto found = byName.find(name);
+        if (found != byName.end()) return SpriteHandle{ found->second };
+
+        int index = (int)rects.size();
+        sf::IntRect placeholder = rects[0];
+        rects.push_back(placeholder);
+        loaded.push_back(false);
+        byName[name] = index;
+
+        std::string path = "assets/" + name + ".png";
+        pending.push_back({ index, std::async(std::launch::async, [path]() -> std::optional<sf::Image>
+            {
+                AllocScope scope(ALLOC_SCOPE::BACKGROUND);
+                sf::Image img;
+                if (img.loadFromFile(path)) return img;
+                return std::nullopt;
+            }) });
+        return SpriteHandle{ index };
+    }
+
+    // Call once a frame from the simulation thread. Packs any finished loads into the atlas;
+    // the pixels only reach the texture on the next Upload()
+    void Poll()
+    {
+        for (auto it = pending.begin(); it != pending.end(); /* no increment here */)
+        {
+            if (it->result.wait_for(std::chrono::seconds(0)) != std::future_status::ready) { ++it; continue; }
+
+            std::optional<sf::Image> img = it->result.get();
+            if (img) Pack(it->index, *img);
+            else std::cout << "[ASSETS]: could not load texture, keeping placeholder\n";
+            it = pending.erase(it);
+        }
+    }
+
+    // Call from the thread that draws, before drawing anything that was packed since the last call
+    void Upload()
+    {
+        std::lock_guard<std::mutex> lock(uploadMutex);
+        for (PendingUpload& u : uploads) atlas.update(u.image, u.position);
+        uploads.clear();
+    }
+
+    bool isLoaded(SpriteHandle h) { return loaded[h.index]; }
+    sf::IntRect getRect(SpriteHandle h) { return rects[h.index]; }
+    const sf::Texture& getTexture() { return atlas; }
+
+private:
+    struct PendingLoad
+    {
+        int index;
+        std::future<std::optional<sf::Image>> result;
+    };
+
+    struct PendingUpload
+    {
+        sf::Image image;
+        sf::Vector2u position;
+    };
+
+    sf::Texture atlas;
+    std::unordered_map<std::string, int> byName;
+    std::vector<sf::IntRect> rects;
+    std::vector<bool> loaded;
+    std::vector<PendingLoad> pending;
+    // Filled by Poll, emptied by Upload, which can be on different threads
+    std::vector<PendingUpload> uploads;
+    std::mutex uploadMutex;
+
+    // Shelf packing: fill rows left to right, start a new row when one is full
+    unsigned shelfX = 0;
+    unsigned shelfY = 0;
+    unsigned shelfHeight = 0;
+
+    // Copy of img with PADDING pixels on every side, each one a copy of the nearest edge pixel
+    static sf::Image Extrude(const sf::Image& img)
+    {
+        sf::Vector2u size = img.getSize();
+        sf::Image padded(sf::Vector2u{ size.x + PADDING * 2, size.y + PADDING * 2 });
+        if (size.x == 0 || size.y == 0) return padded;
+        (void)padded.copy(img, sf::Vector2u{ PADDING, PADDING });
+
+        for (unsigned y = 0; y < size.y + PADDING * 2; y++)
+        {
+            bool edgeRow = y < PADDING || y >= size.y + PADDING;
+            for (unsigned x = 0; x < size.x + PADDING * 2; x++)
+            {
+                // Inside the image already has its pixels, skip straight to the right hand border
+                if (!edgeRow && x == PADDING) x = size.x + PADDING;
+                unsigned sx = std::clamp(x, PADDING, size.x + PADDING - 1) - PADDING;
+                unsigned sy = std::clamp(y, PADDING, size.y + PADDING - 1) - PADDING;
+                padded.setPixel(sf::Vector2u{ x, y }, img.getPixel(sf::Vector2u{ sx, sy }));
+            }
+        }
+        return padded;
+    }
+
+    void Pack(int index, const sf::Image& img)
+    {
+        sf::Vector2u size = img.getSize() + sf::Vector2u{ PADDING * 2, PADDING * 2 };
+        if (shelfX + size.x > ATLAS_SIZE)
+        {
+            shelfX = 0;
+            shelfY += shelfHeight;
+            shelfHeight = 0;
+        }
+        if (size.x > ATLAS_SIZE || shelfY + size.y > ATLAS_SIZE)
+        {
+            std::cout << "[ASSETS]: texture atlas is full, keeping placeholder\n";
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(uploadMutex);
+            uploads.push_back({ Extrude(img), sf::Vector2u{ shelfX, shelfY } });
+        }
+        rects[index] = sf::IntRect({ (int)(shelfX + PADDING), (int)(shelfY + PADDING) }, { (int)(size.x - PADDING * 2), (int)(size.y - PADDING * 2) });
+        loaded[index] = true;
+        shelfX += size.x;
+        shelfHeight = std::max(shelfHeight, size.y);
+    }
+};
+
+// One sprite as the renderer needs it. The atlas rect is looked up when recording,
+// so the render thread never touches the asset cache
+struct RenderQuad
+{
+    sf::IntRect rect;
+    sf::Vector2f position;
+    sf::Vector2f size;
+    sf::Vector2f origin;
+    sf::Color color;
+    sf::Angle rotation;
+};
+
+// Everything needed to draw one frame. Written by the simulation, read-only once published
+struct RenderSnapshot
+{
+    sf::View view;
+    std::vector<RenderQuad> quads;
+};
+
+// Records quads for everything drawn this frame into a snapshot, then builds them into
+// one vertex array and submits them in one draw call with the atlas
+class SpriteBatch
+{
+public:
+    void Begin(RenderSnapshot& into)
+    {
+        frame = &into;
+        frame->quads.clear(); // keeps its capacity, so no allocations once warmed up
+    }
+
+    // origin is relative to the top left of the quad, like sf::Transformable::setOrigin
+    void Add(SpriteHandle sprite, sf::Vector2f pos, sf::Vector2f size, sf::Vector2f origin, sf::Color color, sf::Angle rotation = sf::Angle())
+    {
+        frame->quads.push_back(RenderQuad{ cache->getRect(sprite), pos, size, origin, color, rotation });
+    }
+
+    // Outline drawn as four thin quads, so debug boxes can go in the same batch
+    void AddOutline(sf::Vector2f topLeft, sf::Vector2f size, float thickness, sf::Color color)
+    {
+        SpriteHandle plain;
+        Add(plain, topLeft, sf::Vector2f{ size.x, thickness }, sf::Vector2f(), color);
+        Add(plain, topLeft + sf::Vector2f{ 0, size.y - thickness }, sf::Vector2f{ size.x, thickness }, sf::Vector2f(), color);
+        Add(plain, topLeft, sf::Vector2f{ thickness, size.y }, sf::Vector2f(), color);
+        Add(plain, topLeft + sf::Vector2f{ size.x - thickness, 0 }, sf::Vector2f{ thickness, size.y }, sf::Vector2f(), color);
+    }
+
+    // Safe to call on another thread than the one recording, as long as it's a different snapshot
+    void Flush(sf::RenderTarget& target, const RenderSnapshot& snapshot)
+    {
+        vertices.clear(); // keeps its capacity, so no allocations once warmed up
+        for (const RenderQuad& q : snapshot.quads) AppendQuad(q);
+
+        sf::RenderStates states;
+        states.texture = &cache->getTexture();
+        target.draw(vertices, states);
+    }
+
+    AssetCache* cache;
+
+private:
+    RenderSnapshot* frame = nullptr;
+    sf::VertexArray vertices = sf::VertexArray(sf::PrimitiveType::Triangles);
+
+    void AppendQuad(const RenderQuad& q)
+    {
+        const sf::IntRect& rect = q.rect;
+        sf::Vector2f origin = q.origin;
+        sf::Vector2f size = q.size;
+        float c = std::cos(q.rotation.asRadians());
+        float s = std::sin(q.rotation.asRadians());
+        sf::Vector2f local[4] = { -origin, sf::Vector2f{ size.x, 0 } - origin, size - origin, sf::Vector2f{ 0, size.y } - origin };
+        sf::Vector2f tex[4] = {
+            sf::Vector2f(rect.position),
+            sf::Vector2f((float)(rect.position.x + rect.size.x), (float)rect.position.y),
+            sf::Vector2f(rect.position + rect.size),
+            sf::Vector2f((float)rect.position.x, (float)(rect.position.y + rect.size.y)) };
+
+        sf::Vertex v[4];
+        for (int i = 0; i < 4; i++)
+        {
+            v[i].position = q.position + sf::Vector2f{ local[i].x * c - local[i].y * s, local[i].x * s + local[i].y * c };
+            v[i].color = q.color;
+            v[i].texCoords = tex[i];
+        }
+        // Two triangles per quad
+        vertices.append(v[0]); vertices.append(v[1]); vertices.append(v[2]);
+        vertices.append(v[0]); vertices.append(v[2]); vertices.append(v[3]);
+    }
+};
+
+AssetCache assets;
+SpriteBatch spriteBatch;
+
+
+// Axis aligned bounding box in world space
+struct AABB
+{
+    float minX = 0;
+    float maxX = 0;
+    float minY = 0;
+    float maxY = 0;
+
+    bool overlaps(const AABB& other) const
+    {
+        return minX <= other.maxX && maxX >= other.minX && minY <= other.maxY && maxY >= other.minY;
+    }
+};
+
+// Narrows [t0, t1] to where a + d * t lies between lo and hi (inclusive) on one axis.
+// Returns false if nothing is left. Checking both axes clips a segment to a box
+inline bool ClipToSlab(float a, float d, float lo, float hi, float& t0, float& t1)
+{
+    if (d == 0) return a >= lo && a <= hi;
+    float ta = (lo - a) / d;
+    float tb = (hi - a) / d;
+    if (ta > tb) std::swap(ta, tb);
+    t0 = std::max(t0, ta);
+    t1 = std::min(t1, tb);
+    return t0 <= t1;
+}
+
+// Every GameObject's AABB lives in here, next to each other, so broadphase code can walk them
+// without touching the objects themselves. Slots of deleted objects get reused
+class AABBStore
+{
+public:
+    std::vector<AABB> boxes;
+
+    int Allocate()
+    {
+        if (!freeSlots.empty())
+        {
+            int slot = freeSlots.back();
+            freeSlots.pop_back();
+            return slot;
+        }
+        boxes.push_back(AABB());
+        return (int)boxes.size() - 1;
+    }
+
+    void Free(int slot)
+    {
+        freeSlots.push_back(slot);
+    }
+
+private:
+    std::vector<int> freeSlots;
+};
+
+// One per thread: a world and everything in it stays on the thread that made it
+thread_local AABBStore aabbStore;
+
+class GameObject;
+
+// 32 bit reference to a GameObject: low 20 bits are a slot in the HandleTable, high 12 bits the slot's
+// generation. Destroying the object bumps the generation, so old handles stop resolving instead of dangling
+struct EntityHandle
+{
+    static const std::uint32_t INDEX_BITS = 20;
+    static const std::uint32_t INDEX_MASK = (1u << INDEX_BITS) - 1;
+    static const std::uint32_t GENERATION_MASK = (1u << (32 - INDEX_BITS)) - 1;
+
+    std::uint32_t value = 0; // 0 = null, generations start at 1
+
+    std::uint32_t index() const { return value & INDEX_MASK; }
+    std::uint32_t generation() const { return value >> INDEX_BITS; }
+    bool isNull() const { return value == 0; }
+    bool operator==(const EntityHandle& other) const { return value == other.value; }
+    bool operator!=(const EntityHandle& other) const { return value != other.value; }
+};
+
+// Maps handles to wherever the object currently lives. Anything that is allowed to move or be
+// destroyed/pooled should be referred to by handle, only the owner keeps the pointer.
+// Freed slots are reused oldest first, and only once MIN_FREE of them are waiting, so a slot's generation goes up
+// slowly even when something is created and destroyed every tick. A slot whose generation would wrap back to an
+// old value is never reused
+class HandleTable
+{
+public:
+    static const std::uint32_t MIN_FREE = 1024;
+
+    EntityHandle Create(GameObject* g)
+    {
+        std::uint32_t index;
+        if (freeCount > MIN_FREE)
+        {
+            index = freeSlots[freeHead];
+            freeHead = (freeHead + 1) % freeSlots.size();
+            freeCount--;
+        }
+        else
+        {
+            index = (std::uint32_t)objects.size();
+            if (index > EntityHandle::INDEX_MASK) throw std::runtime_error("Out of entity handles");
+            objects.push_back(nullptr);
+            generations.push_back(1);
+        }
+        objects[index] = g;
+        return EntityHandle{ (generations[index] << EntityHandle::INDEX_BITS) | index };
+    }
+
+    // Invalidates every copy of h. Does nothing if h is already stale
+    void Destroy(EntityHandle h)
+    {
+        if (Resolve(h) == nullptr) return;
+        std::uint32_t index = h.index();
+        objects[index] = nullptr;
+        // Generations start at 1 so a live handle is never null. Bumping past the last one would bring back
+        // handles that are still around somewhere, so the slot is retired instead
+        if (generations[index] == EntityHandle::GENERATION_MASK)
+        {
+            retiredSlots++;
+            return;
+        }
+        generations[index]++;
+        PushFree(index);
+    }
+
+    // Returns nullptr for null or stale handles
+    GameObject* Resolve(EntityHandle h)
+    {
+        std::uint32_t index = h.index();
+        if (h.isNull() || index >= objects.size() || generations[index] != h.generation()) return nullptr;
+        return objects[index];
+    }
+
+    template <typename T>
+    T* Resolve(EntityHandle h)
+    {
+        return static_cast<T*>(Resolve(h));
+    }
+
+    // For when the owner moves an object in memory (compacting, growing a pool). Handles stay valid
+    void Relocate(EntityHandle h, GameObject* newAddress)
+    {
+        if (Resolve(h) == nullptr) throw std::runtime_error("Relocating a stale handle");
+        objects[h.index()] = newAddress;
+    }
+
+    int Retired() const { return retiredSlots; }
+
+private:
+    std::vector<GameObject*> objects;
+    std::vector<std::uint32_t> generations;
+    // Ring buffer of free slots: freeCount of them starting at freeHead. Only ever grows, so once it is big
+    // enough creating and destroying doesn't allocate
+    std::vector<std::uint32_t> freeSlots;
+    size_t freeHead = 0;
+    size_t freeCount = 0;
+    int retiredSlots = 0;
+
+    void PushFree(std::uint32_t index)
+    {
+        if (freeCount == freeSlots.size())
+        {
+            // Full: unroll it into a bigger one
+            std::vector<std::uint32_t> bigger(std::max<size_t>(64, freeSlots.size() * 2));
+            for (size_t i = 0; i < freeCount; i++) bigger[i] = freeSlots[(freeHead + i) % freeSlots.size()];
+            freeSlots.swap(bigger);
+            freeHead = 0;
+        }
+        freeSlots[(freeHead + freeCount) % freeSlots.size()] = index;
+        freeCount++;
+    }
 };
 
+thread_local HandleTable entities; // Per thread, like aabbStore
+
 class GameObject
 {
     public:
+        GameObject()
+        {
+            aabbSlot = aabbStore.Allocate();
+            handle = entities.Create(this);
+        }
+        GameObject(const GameObject&) = delete; // Would share the AABB slot
+        GameObject& operator=(const GameObject&) = delete;
+
         WORLD_GROUP group = WORLD_GROUP::OTHER;
         COLLISIONTYPE collisionType = COLLISIONTYPE::NONE;
         // Whether the collision boundaries have been established
@@ -43,12 +711,33 @@ class GameObject
         float colBox_Height;
         float colCircle_radius;
 
+        virtual ~GameObject()
+        {
+            aabbStore.Free(aabbSlot);
+            entities.Destroy(handle);
+        }
+
+        // How everything except the owner should refer to this
+        EntityHandle handle;
+
         GAMETAG getTag() { return this->tag; }
         virtual std::string debugInfo() = 0; // Force override
 
+        float health = 1;
+        float maxHealth = 1;
+        bool alive = true;
+        int flashFrames = 0; // Drawn white for this many frames after being hit
+
+        // Only called by DamageQueue::Resolve
         virtual void TakeDamage(float damage)
         {
-            std::cout << this->debugInfo() << " was hit\n";
+            health -= damage;
+        }
+
+        // Called once when health drops to 0
+        virtual void OnDeath()
+        {
+            alive = false;
         }
          
         // Establishes boundaries of collision box
@@ -59,6 +748,7 @@ class GameObject
             this->colBox_Width = w;
             this->colBox_Height = h;
             this->collisionIsSetup = true;
+            aabbDirty = true;
         }
 
         // Establishes boundaries of collision circle
@@ -67,13 +757,34 @@ class GameObject
             this->collisionType = COLLISIONTYPE::CIRCLE;
             this->colCircle_radius = radius;
             this->collisionIsSetup = true;
+            aabbDirty = true;
         }
 
         void setCollisionAs_Pt()
         {
             this->collisionType = COLLISIONTYPE::POINT;
             this->collisionIsSetup = true;
+            aabbDirty = true;
+        }
+
+        // World space bounds of the collision shape. Only recalculated after the position or shape changed
+        const AABB& getAABB()
+        {
+            AABB& box = aabbStore.boxes[aabbSlot];
+            if (!aabbDirty) return box;
+
+            sf::Vector2f p = getPosition();
+            if (collisionType == COLLISIONTYPE::BOX)
+            {
+                if (collisionBoxOrigin == COLLISIONBOXORIGIN::TOPLEFT) box = AABB{ p.x, p.x + colBox_Width, p.y, p.y + colBox_Height };
+                else box = AABB{ p.x - colBox_Width / 2, p.x + colBox_Width / 2, p.y - colBox_Height / 2, p.y + colBox_Height / 2 };
+            }
+            else if (collisionType == COLLISIONTYPE::CIRCLE) box = AABB{ p.x - colCircle_radius, p.x + colCircle_radius, p.y - colCircle_radius, p.y + colCircle_radius };
+            else box = AABB{ p.x, p.x, p.y, p.y }; // Points, and objects without collision
+            aabbDirty = false;
+            return box;
         }
+        int getAABBSlot() { return aabbSlot; }
 
 
         sf::Vector2f getPosition()
@@ -83,6 +794,7 @@ class GameObject
         void setPosition(sf::Vector2f pos)
         {
             position = pos;
+            aabbDirty = true;
             // Update partition
         }
         // Adds vector to position. (You need to multiply by deltatime yourself if you want framerate independence)
@@ -94,6 +806,16 @@ class GameObject
         {
             return 0;
         }
+        virtual void Draw() {}
+
+        // Region of the atlas this draws with
+        SpriteHandle sprite;
+        // Colour to draw with: plain white once the texture has loaded, otherwise the placeholder tinted
+        sf::Color getTint(sf::Color placeholderColor)
+        {
+            if (flashFrames > 0) return sf::Color::White;
+            return assets.isLoaded(sprite) ? sf::Color::White : placeholderColor;
+        }
 
         bool isCollidingWith(GameObject* other)
         {
@@ -115,8 +837,12 @@ class GameObject
             }
             else if (other->collisionType == COLLISIONTYPE::POINT)
             {
-                if (this->collisionType == COLLISIONTYPE::POINT) throw std::runtime_error("Point to point collision has not been implemented!");
+                if (this->collisionType == COLLISIONTYPE::BOX) return ptCollidesBox(other, this);
+                else if (this->collisionType == COLLISIONTYPE::CIRCLE) return ptCollidesCircle(other, this);
+                else if (this->collisionType == COLLISIONTYPE::POINT) throw std::runtime_error("Point to point collision has not been implemented!");
+                else throw std::runtime_error("'this' colllisionType is not valid");
             }
+            else throw std::runtime_error("'other' colllisionType is not valid");
         }
 
         // Collision related methods
@@ -146,8 +872,8 @@ class GameObject
         {
             float radius = c1->colCircle_radius;
             sf::Vector2f circleCenter = c1->getPosition();
-            sf::Vector2f boxPos = getColBoxTopLeft();
-            sf::Vector2f boxSize = sf::Vector2f{ colBox_Width, colBox_Height };
+            sf::Vector2f boxPos = b1->getColBoxTopLeft();
+            sf::Vector2f boxSize = sf::Vector2f{ b1->colBox_Width, b1->colBox_Height };
 
             float closestX = std::clamp(circleCenter.x,
                 boxPos.x,
@@ -169,77 +895,83 @@ class GameObject
             return (d.x * d.x + d.y * d.y) <= r * r;
         }
 
-        sf::Vector2f getColBoxTopLeft()
+        // Whether the segment from a to b touches the collision shape. t is how far along it (0 to 1) that first
+        // happens, 0 if a is already inside. Points are never hit
+        bool segmentCollides(sf::Vector2f a, sf::Vector2f b, float& t)
         {
-            if (collisionBoxOrigin == COLLISIONBOXORIGIN::TOPLEFT) return getPosition();
-            else if (collisionBoxOrigin == COLLISIONBOXORIGIN::CENTER) return getPosition() - sf::Vector2f{ colBox_Width / 2, colBox_Height / 2 };
-        }
-        std::array<float, 4> GetColBoxBounds()
-        {
-            std::array<float, 4> result;
-            float minX, maxX, minY, maxY;
-            if (collisionBoxOrigin == COLLISIONBOXORIGIN::TOPLEFT)
+            sf::Vector2f d = b - a;
+            if (collisionType == COLLISIONTYPE::BOX)
             {
-                minX = getPosition().x;
-                maxX = getPosition().x + colBox_Width;
-                minY = getPosition().y;
-                maxY = getPosition().y + colBox_Height;
+                const AABB& box = getAABB();
+                float t0 = 0;
+                float t1 = 1;
+                if (!ClipToSlab(a.x, d.x, box.minX, box.maxX, t0, t1) || !ClipToSlab(a.y, d.y, box.minY, box.maxY, t0, t1)) return false;
+                t = t0;
+                return true;
             }
-            else if (collisionBoxOrigin == COLLISIONBOXORIGIN::CENTER)
+            else if (collisionType == COLLISIONTYPE::CIRCLE)
             {
-                minX = getPosition().x - colBox_Width/2;
-                maxX = getPosition().x + colBox_Width/2;
-                minY = getPosition().y - colBox_Height / 2;
-                maxY = getPosition().y + colBox_Height/2;
+                // Solves |a + d * t - centre| = radius for the first t
+                sf::Vector2f f = a - getPosition();
+                float c = f.x * f.x + f.y * f.y - colCircle_radius * colCircle_radius;
+                if (c <= 0) { t = 0; return true; }
+                float dd = d.x * d.x + d.y * d.y;
+                float fd = f.x * d.x + f.y * d.y;
+                float discriminant = fd * fd - dd * c;
+                float hit = dd != 0 && discriminant >= 0 ? (-fd - std::sqrt(discriminant)) / dd : -1;
+                if (hit >= 0 && hit <= 1) { t = hit; return true; }
+
+                // Rounding can put a segment that ends exactly on the edge just past 1, so check the end itself
+                sf::Vector2f g = b - getPosition();
+                if (g.x * g.x + g.y * g.y > colCircle_radius * colCircle_radius) return false;
+                t = 1;
+                return true;
             }
-            return { minX, maxX, minY, maxY };
-            
+            return false;
+        }
+
+        sf::Vector2f getColBoxTopLeft()
+        {
+            const AABB& b = getAABB();
+            return sf::Vector2f{ b.minX, b.minY };
         }
-        virtual std::vector<sf::Vector2f> GetBounds()
+        std::array<float, 4> GetColBoxBounds()
         {
-            if (collisionType == COLLISIONTYPE::BOX)
-            {
-                // minX, maxX, minY, maxY
-                std::array<float, 4> b = GetColBoxBounds();
-                std::vector<sf::Vector2f> theBounds;
-                theBounds.push_back(sf::Vector2f{b[0], b[2]});
-                theBounds.push_back(sf::Vector2f{ b[0], b[3] });
-                theBounds.push_back(sf::Vector2f{ b[1], b[2] });
-                theBounds.push_back(sf::Vector2f{ b[1], b[3] });
-                return theBounds;
-            }
-            else if (collisionType == COLLISIONTYPE::CIRCLE) throw std::runtime_error("Error: GetBounds on circle not implemented!");
-            else if (collisionType == COLLISIONTYPE::POINT) return std::vector<sf::Vector2f>{getPosition()};
-            else throw std::runtime_error("Collision not set up!");
+            const AABB& b = getAABB();
+            return { b.minX, b.maxX, b.minY, b.maxY };
+            
         }
-
         // Returns true if colliding with any in list
-        bool CheckForCollisionsAny(std::vector<GameObject*> list)
+        bool CheckForCollisionsAny(const std::vector<EntityHandle>& list)
         {
             if (!collisionIsSetup) throw std::runtime_error("Collision is not set up for Gameobject!");
-            for (GameObject* g : list)
+            for (EntityHandle h : list)
             {
-                if (this->isCollidingWith(g)) return true;
+                GameObject* g = entities.Resolve(h);
+                if (g != nullptr && this->isCollidingWith(g)) return true;
             }
             return false;
         }
 
-        // Returns a list of all GameObjects in list it is colliding with. Returns an empty vector if none.
-        std::vector<GameObject*> GetCollisionsAll(std::vector<GameObject*> list)
+        // Fills out with everything in list it is colliding with (clears it first). Passing the same vector
+        // every time means no allocations once it has grown
+        void GetCollisionsAll(const std::vector<EntityHandle>& list, std::vector<EntityHandle>& out)
         {
             if (!collisionIsSetup) throw std::runtime_error("Collision is not set up for Gameobject: " + this->debugInfo());
-            std::vector<GameObject*> out;
-            for (GameObject* g : list)
+            out.clear();
+            for (EntityHandle h : list)
             {
-                if (this->isCollidingWith(g)) out.push_back(g);
+                GameObject* g = entities.Resolve(h);
+                if (g != nullptr && this->isCollidingWith(g)) out.push_back(h);
             }
-            return out;
         }
     protected:
         GAMETAG tag;
     private:
         sf::Vector2f position;
         COLLISIONBOXORIGIN collisionBoxOrigin;
+        int aabbSlot;
+        bool aabbDirty = true;
         
 };
 
@@ -247,30 +979,10 @@ struct GridCell
 {
     sf::Vector2f topLeft;
     sf::Vector2f bottomRight;
-    // Groupnames: 0=player, 1=enemy, 2=wall, 3=other
-    std::vector<std::string> groupNames;
-    std::vector<std::vector<GameObject*>> groups;
     //std::vector<GameObject*> contents;
-    bool isActive = false;
     //bool isActive = false;
     sf::Vector2f getSize() { return sf::Vector2f({ bottomRight.x - topLeft.x, bottomRight.y - topLeft.y }); }
 
-    GridCell()
-    {
-        groups = std::vector<std::vector<GameObject*>>(5);
-        groupNames = { "player", "enemy", "wall", "bullet", "other" };
-    }
-
-    std::string getGroupName(int index)
-    {
-        return groupNames[index];
-    }
-    
-    std::vector<GameObject*> getGroup(int index)
-    {
-        return groups[index];
-    }
-
     bool contains(float x, float y) {
         return (x >= topLeft.x && x < bottomRight.x &&
             y >= topLeft.y && y < bottomRight.y);
@@ -278,12 +990,8 @@ struct GridCell
 
     bool containsObject(GameObject* g)
     {
-        std::vector<sf::Vector2f> bounds = g->GetBounds();
-        for (sf::Vector2f v : bounds)
-        {
-            if (contains(v.x, v.y)) return true;
-        }
-        return false;
+        const AABB& b = g->getAABB();
+        return b.minX < bottomRight.x && b.maxX >= topLeft.x && b.minY < bottomRight.y && b.maxY >= topLeft.y;
     }
 }
 ;
@@ -310,36 +1018,7 @@ public:
         return _grid[index];
     }
 
-    void printDebug()
-    {
-        std::cout << "[GRID]: " << _ROWS << "x" << _COLS << "\n";
-        for (int i = 0; i < _grid.size(); i++)
-        {
-            sf::Vector2i coords = index2Coords(i);
-            std::cout << "CELL " << coords.y << ", " << coords.x << ": " << _grid[i].isActive << "\n";
-            std::cout << "groupnames size: " << _grid[i].groupNames.size() << "\n";
-            std::cout << "groups size: " << _grid[i].groups.size() << "\n";
-            std::cout << "groups: ";
-            for (int j = 0; j < _grid[i].groups.size(); j++)
-            {
-                std::cout << "[[GROUP " << _grid[i].groupNames[j] << "]],";
-            }
-            std::cout << "\n";
-            // For groups
-            for (int j = 0; j < _grid[i].groups.size(); j++)
-            {
-                std::cout << "[[GROUP " << _grid[i].groupNames[j] << "]]:\n";
-                for (GameObject* g : _grid[i].getGroup(j))
-                {
-                    std::cout << g->debugInfo() << "\n";
-                }
-                std::cout << "\n";
-            }
-        }
-        
-    }
-
-    void Generate(float mapWidth, float mapHeight, int cols, int rows)
+    void Generate(float mapWidth, float mapHeight, int cols, int rows)
     {
         _COLS = cols;
         _ROWS = rows;
@@ -386,706 +1065,5153 @@ public:
     }
 
 
-    // Returns index of gridcell associated with this world positon.
+    // Whether a world position is inside the room this grid covers
+    bool isInBounds(sf::Vector2f pos)
+    {
+        return pos.x >= 0 && pos.y >= 0 && pos.x <= MAPWIDTH && pos.y <= MAPHEIGHT;
+    }
+
+    // Returns index of gridcell associated with this world positon. Returns -1 if outside the room
     int Position2CellIndex(sf::Vector2f pos)
     {
+        if (!isInBounds(pos)) return -1;
         int x = _getPos(pos.x, MAPWIDTH, _COLS);
         int y = _getPos(pos.y, MAPHEIGHT, _ROWS);
         
         return coord2Index(x, y);
 
     }
-    // Places the provided gameobject in the appropriate partition(s) based on its position. 
-    // Also returns the indices of all partitions it is in
-    std::set<int> PlaceInPartitions(GameObject* g)
+    // Range of cells (inclusive) a world space box overlaps, clamped to the grid.
+    // Returns false if the box is completely outside the room
+    bool GetCellRange(const AABB& box, int& x0, int& y0, int& x1, int& y1)
     {
+        if (box.maxX < 0 || box.maxY < 0 || box.minX > MAPWIDTH || box.minY > MAPHEIGHT) return false;
+        float cellW = (float)MAPWIDTH / _COLS;
+        float cellH = (float)MAPHEIGHT / _ROWS;
+        x0 = std::clamp((int)std::floor(box.minX / cellW), 0, _COLS - 1);
+        y0 = std::clamp((int)std::floor(box.minY / cellH), 0, _ROWS - 1);
+        x1 = std::clamp((int)std::floor(box.maxX / cellW), 0, _COLS - 1);
+        y1 = std::clamp((int)std::floor(box.maxY / cellH), 0, _ROWS - 1);
+        return true;
+    }
 
-        std::set<int> result;
-        std::vector<sf::Vector2f> bounds = g->GetBounds();
-        for (sf::Vector2f b : bounds)
+    // Fills out with the indices of every cell overlapping rect (clears it first).
+    // Passing the same vector every frame means no allocations once it has grown
+    void GetCellsInRect(sf::FloatRect rect, std::vector<int>& out)
+    {
+        out.clear();
+        int minX, minY, maxX, maxY;
+        AABB box = AABB{ rect.position.x, rect.position.x + rect.size.x, rect.position.y, rect.position.y + rect.size.y };
+        if (!GetCellRange(box, minX, minY, maxX, maxY)) return;
+        for (int y = minY; y <= maxY; y++)
         {
-            int ind = Position2CellIndex(b);
-            // Only add if target is valid position within game world
-            if (ind < _grid.size())
+            for (int x = minX; x <= maxX; x++)
             {
-                // Check group of object, add to the correct collection
-                int groupIndex = static_cast<int>(g->group);
-                _grid[ind].groups[groupIndex].push_back(g);
-                if (g->getTag() == GAMETAG::PLAYER) _grid[ind].isActive = true;
-                result.insert(ind);
+                out.push_back(coord2Index(x, y));
             }
-           
-        }
-        return result;
-    }
-        
-    // Removes gameobject from every partition provided by a list of indices.
-    void RemoveFromPartitions(GameObject* g, std::set<int> index_list)
-    {
-        for (int i : index_list)
-        {
-            if (g->getTag() == GAMETAG::PLAYER) _grid[i].isActive = false;
-            int _thegroup = static_cast<int>(g->group);
-            auto& contents = _grid[i].groups[_thegroup];  // get vector of objects in this cell
-            // erase-remove idiom to remove the pointer
-            //contents.clear();
-            contents.erase(std::remove(contents.begin(), contents.end(), g), contents.end());
-            //contents.clear();
         }
     }
 
-    void RenderGrid()
+    // Only draws the cells overlapping the view. Cells any of the highlight boxes are in (the players) get the active
+    // colour. Without fill only the outlines are drawn (so the room background shows)
+    void RenderGrid(sf::FloatRect view, bool fill, std::span<const AABB> highlight)
     {
-        for (int i = 0; i < _ROWS; i++)
+        GetCellsInRect(view, visibleCells);
+        for (int i : visibleCells)
         {
-            for (int j = 0; j < _COLS; j++)
+            GridCell& cell = _grid[i];
+            sf::Vector2i c = index2Coords(i);
+            bool active = false;
+            for (const AABB& box : highlight)
             {
-                GridCell cell = get(j, i);
-                sf::RectangleShape r = sf::RectangleShape(sf::Vector2f({ cell.getSize() }));
-                r.setPosition(cell.topLeft);
-                
-                if (cell.isActive) r.setFillColor(regionActiveColor);
-                else r.setFillColor(regionNormalColor);
-                r.setOutlineColor(sf::Color::Black);
-                r.setOutlineThickness(1.0f);
-                window->draw(r);
+                int x0, y0, x1, y1;
+                if (GetCellRange(box, x0, y0, x1, y1) && c.x >= x0 && c.x <= x1 && c.y >= y0 && c.y <= y1) active = true;
             }
+            sf::Color color = active ? regionActiveColor : regionNormalColor;
+            if (fill) spriteBatch.Add(SpriteHandle(), cell.topLeft, cell.getSize(), sf::Vector2f(), color);
+            spriteBatch.AddOutline(cell.topLeft, cell.getSize(), 1.0f, sf::Color::Black);
         }
     }
+
+private:
+    std::vector<int> visibleCells;
+};
+
+// Follows the player around rooms bigger than the screen
+class Camera
+{
+public:
+    sf::View view;
+
+    void Init(sf::Vector2f size)
+    {
+        view.setSize(size);
+        view.setCenter(size / 2.0f);
+    }
+
+    // Centers on target but never shows anything outside the room. Rooms smaller than the view stay centered
+    void Follow(sf::Vector2f target, sf::Vector2f roomSize)
+    {
+        sf::Vector2f size = view.getSize();
+        sf::Vector2f center = target;
+        if (roomSize.x <= size.x) center.x = roomSize.x / 2;
+        else center.x = std::clamp(center.x, size.x / 2, roomSize.x - size.x / 2);
+        if (roomSize.y <= size.y) center.y = roomSize.y / 2;
+        else center.y = std::clamp(center.y, size.y / 2, roomSize.y - size.y / 2);
+        view.setCenter(center);
+    }
+
+    // World-space rectangle currently on screen
+    sf::FloatRect getVisibleRect()
+    {
+        return sf::FloatRect(view.getCenter() - view.getSize() / 2.0f, view.getSize());
+    }
 };
 
+// Something that lives in a room. Only knows the room's grid for its bounds: where things are for collision and
+// drawing is in the world's broadphase, which is rebuilt from positions every tick
 class GridGameObject : public GameObject
 {
     public:
         Grid* grid;
-        std::set<int> gridPartitions = std::set<int>({}); // Stores which current partitions this is in
 
         virtual void Init(Grid* g)
         {
             grid = g;
         }
 
-        void setPosition(sf::Vector2f pos)
+        // Leaves it where it is, but nothing collides with or draws it any more
+        void Despawn()
         {
-            GameObject::setPosition(pos);
+            alive = false;
+        }
 
-            // Check if still in partitions
-            /*for (int i : gridPartitions)
-            {
-                //if (!grid.getByIndex(i).containsObject(this)
-            }*/
-            // Repartition this
-            if (gridPartitions.size() != 0) grid->RemoveFromPartitions(this, gridPartitions);
-            gridPartitions = grid->PlaceInPartitions(this);
-            
+};
+
+// Fixed size blocks for behaviour coroutine frames. Freed frames are kept and reused, so starting
+// behaviours for thousands of enemies doesn't keep hitting the heap
+class CoroutineFramePool
+{
+public:
+    static const size_t BLOCK_SIZE = 512;
+
+    static void* Allocate(size_t size)
+    {
+        if (size > BLOCK_SIZE) return ::operator new(size);
+        if (!freeBlocks.blocks.empty())
+        {
+            void* p = freeBlocks.blocks.back();
+            freeBlocks.blocks.pop_back();
+            return p;
         }
+        return ::operator new(BLOCK_SIZE);
+    }
+
+    static void Free(void* p, size_t size)
+    {
+        if (size > BLOCK_SIZE) ::operator delete(p);
+        else freeBlocks.blocks.push_back(p);
+    }
+
+private:
+    struct FreeList
+    {
+        std::vector<void*> blocks;
+        ~FreeList() { for (void* p : blocks) ::operator delete(p); }
+    };
 
+    // Per thread, so worlds on different threads never share it
+    static inline thread_local FreeList freeBlocks;
 };
 
-class Bullet : public GridGameObject
+class BehaviourScheduler;
+
+// Where an object's behaviour is up to. Lives on the owner, so it is saved and restored with the rest of
+// its state, and after a rollback the script is started again from here instead of being rewound.
+// Scripts keep step up to date themselves: before every co_await, set it to wherever a fresh start of
+// the script should pick up after that wait
+struct BehaviourProgress
 {
+    int step = 0;
+    int wakeTick = -1; // Tick it resumes on, -1 if it isn't running. Kept up to date by the scheduler
+};
 
-public:
-    //static int count;
-    int id;
-    sf::Vector2f v;
-    GameObject* owner;
-    std::vector<WORLD_GROUP> canDamage;
-    float bulletDamageAmount;
+// A script written as a coroutine, e.g. "move for 2s, fire, wait 0.5s". Does nothing until handed
+// to a BehaviourScheduler, which then owns it
+struct Behaviour
+{
+    struct promise_type
+    {
+        BehaviourScheduler* scheduler = nullptr;
+        BehaviourProgress* progress = nullptr;
+        int wakeTick = 0; // Set by whatever it is waiting on
 
-    // Settings
+        Behaviour get_return_object() { return Behaviour{ std::coroutine_handle<promise_type>::from_promise(*this) }; }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { throw; }
 
-    // COLLISION LAYER is which layer can be hurt by this type of bullet
-    Bullet(float _damageAmt, sf::Vector2f velocity, sf::Vector2f pos, int count, Grid* g, std::vector<WORLD_GROUP> _canDamage, GameObject* _owner = nullptr)
+        static void* operator new(size_t size) { return CoroutineFramePool::Allocate(size); }
+        static void operator delete(void* p, size_t size) { CoroutineFramePool::Free(p, size); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+// Resumes behaviours when the tick they are waiting for comes round. Sleeping behaviours sit in a
+// heap ordered by wake tick, so only the ones that are due get touched. Ones due on the same tick go in
+// owner handle order, which a restored world gets the same as the original
+class BehaviourScheduler
+{
+public:
+    int currentTick = 0;
+
+    ~BehaviourScheduler()
     {
-        this->bulletDamageAmount = _damageAmt;
-        this->group = WORLD_GROUP::BULLET;
-        this->setCollisionAs_Pt();
-        this->canDamage = _canDamage;
-        this->owner = _owner;
-        this->tag = GAMETAG::BULLET;
-        this->grid = g;
-        id = count;
-        setPosition(pos);
-        v = velocity;
-        count += 1;
-        std::cout << "Bullet[" << id << "]" << " with velocity " << v.x << "," << v.y << "\n";
-        
+        Clear();
     }
 
-    std::string debugInfo() override
+    // Runs until owner is gone or dead, or the behaviour returns. progress belongs to the owner: if it has a
+    // wake tick (restored from a snapshot) the behaviour sleeps until then, otherwise it starts this tick
+    void Start(Behaviour b, EntityHandle owner, BehaviourProgress& progress)
     {
-        return "Bullet" + id;
+        b.handle.promise().scheduler = this;
+        b.handle.promise().progress = &progress;
+        push(b.handle, owner, progress.wakeTick >= 0 ? progress.wakeTick : currentTick);
     }
 
-    int Update(float dt)
+    // Resumes everything due on tick. After a rollback the world clears this and starts every behaviour
+    // again from its owner's restored progress, so replayed ticks run the same as the first time
+    void Tick(int tick)
     {
+        currentTick = tick;
+        while (!sleeping.empty() && sleeping.front().wakeTick <= currentTick)
+        {
+            std::pop_heap(sleeping.begin(), sleeping.end(), later);
+            Sleeping next = sleeping.back();
+            sleeping.pop_back();
 
-        setPosition(getPosition() + v * dt); //cant use this version because it will try to move it to a partition off the screen
+            // progress is on the owner, so only touch it while the owner is still there
+            GameObject* owner = entities.Resolve(next.owner);
+            if (owner == nullptr || !owner->alive)
+            {
+                if (owner != nullptr) next.handle.promise().progress->wakeTick = -1;
+                next.handle.destroy();
+                continue;
+            }
 
-        sf::Vector2f position = getPosition();
-        // If go off screen
-        if (position.y < 0 || position.x < 0 || position.x > SCREEN_WIDTH || position.y > SCREEN_HEIGHT)
-        {
-            // Remove from partitions
-            return -1; // Signal to BulletManager to delete this
-        }
-        // COLLISION STUFF
-        //GET THE GRID SUBINDEX
-        int _gridindex = *this->gridPartitions.begin(); // It will only be in one since bullet is special case
-        
-        //Check colliding with target
-        for (WORLD_GROUP w_group : canDamage)
-        {
-            // This is everything to check collisions with
-            std::vector<GameObject*> collection = this->grid->getByIndex(_gridindex).getGroup(static_cast<int>(w_group));
-            // This is the subset containing all objects we are colliding with
-            std::vector<GameObject*> colliding = this->GetCollisionsAll(collection);
-            if (colliding.size() > 0)
+            next.handle.resume();
+            if (next.handle.done())
             {
-                if (BULLETS_DAMAGE_ALL)
-                {
-                    for (GameObject* g : colliding)
-                    {
-                        g->TakeDamage(bulletDamageAmount);
-                    }
-                    return -1;
-                }
-                else
-                {
-                    colliding[0]->TakeDamage(bulletDamageAmount);
-                    return -1;
-                }
+                next.handle.promise().progress->wakeTick = -1;
+                next.handle.destroy();
             }
-            
+            else push(next.handle, next.owner, next.handle.promise().wakeTick);
         }
-        
+        currentTick++;
+    }
 
-        return 0;
+    // Stops every behaviour
+    void Clear()
+    {
+        for (Sleeping& s : sleeping) s.handle.destroy();
+        sleeping.clear();
     }
 
+    int activeCount() { return (int)sleeping.size(); }
 
+private:
+    struct Sleeping
+    {
+        int wakeTick;
+        std::uint64_t order; // Same wake tick and owner -> resumed in the order they went to sleep
+        EntityHandle owner;
+        std::coroutine_handle<Behaviour::promise_type> handle;
+    };
 
+    std::vector<Sleeping> sleeping;
+    std::uint64_t nextOrder = 0;
 
-    void Draw()
+    static bool later(const Sleeping& a, const Sleeping& b)
     {
-        sf::RectangleShape r = sf::RectangleShape(sf::Vector2f({ 5,5 }));
-        r.setFillColor(sf::Color::Magenta);
-        //r.setOrigin(sf::Vector2f({ 2.5f, 2.5f }));
-        r.setPosition(getPosition());
-        window->draw(r);
+        if (a.wakeTick != b.wakeTick) return a.wakeTick > b.wakeTick;
+        if (a.owner != b.owner) return a.owner.value > b.owner.value;
+        return a.order > b.order;
+    }
+
+    void push(std::coroutine_handle<Behaviour::promise_type> h, EntityHandle owner, int wakeTick)
+    {
+        h.promise().progress->wakeTick = wakeTick;
+        sleeping.push_back(Sleeping{ wakeTick, nextOrder++, owner, h });
+        std::push_heap(sleeping.begin(), sleeping.end(), later);
     }
 };
 
-// One instance of this in game
-class BulletManager
+// co_await WaitTicks{ n } inside a Behaviour to sleep for n ticks
+struct WaitTicks
 {
-    private: 
-        std::vector<Bullet*> playerBullets;
-        std::vector<Bullet*> enemyBullets;
+    int ticks;
 
-    public:
-        Grid* grid;
-        GameObject* player;
+    bool await_ready() { return ticks <= 0; }
+    void await_suspend(std::coroutine_handle<Behaviour::promise_type> h)
+    {
+        h.promise().wakeTick = h.promise().scheduler->currentTick + ticks;
+    }
+    void await_resume() {}
+};
 
+// co_await Wait(0.5f) sleeps for that many seconds (rounded up to whole ticks)
+WaitTicks Wait(float seconds)
+{
+    return WaitTicks{ (int)std::ceil(seconds / TICK_DT) };
+}
 
-        void createBullet(int bulletType, sf::Vector2f pos, sf::Vector2f dir, GameObject* owner)
-        {
-            Bullet* b;
-            if (bulletType == 0) b = new Bullet(10, dir * 600.0f, pos, getBulletCount(0), grid, std::vector<WORLD_GROUP>{WORLD_GROUP::ENEMY}, owner);
-            else if (bulletType == 1) b = new Bullet(10, dir * 600.0f , pos, getBulletCount(1), grid, std::vector<WORLD_GROUP>{WORLD_GROUP::PLAYER}, owner);
-            else throw std::invalid_argument("Invalid bullet type");
+enum class DAMAGE_KIND {BULLET, CONTACT, OTHER};
+// FIRST: a bullet only damages the first thing it hits. ALL: it damages everything it overlaps on that tick
+enum class BULLET_HIT_POLICY {FIRST, ALL};
 
-            addBullet(bulletType, b);
-        }
+// One hit, recorded during collision and applied later. Collision code never touches the target directly
+struct DamageEvent
+{
+    EntityHandle target;
+    EntityHandle source; // Whoever fired it, can be null or stale by the time this is applied
+    float amount;
+    DAMAGE_KIND kind;
+};
 
-        void DrawBullets()
-        {
-            for (auto& b : playerBullets)
-            {
-                b->Draw();
-            }
+// Collects every hit during a tick, then applies them all at once in Resolve(). Keeps collision
+// read-only on the targets, so it doesn't matter what order (or thread) collisions are checked in
+class DamageQueue
+{
+public:
+    BULLET_HIT_POLICY bulletHitPolicy = BULLET_HIT_POLICY::FIRST;
+
+    // Called for every event that got applied, after death has been handled. killed is true for the hit that killed the target
+    std::vector<std::function<void(const DamageEvent&, GameObject* target, bool killed)>> listeners;
+
+    void Push(EntityHandle target, EntityHandle source, float amount, DAMAGE_KIND kind)
+    {
+        events.push_back(DamageEvent{ target, source, amount, kind });
+    }
 
-            for (auto& b : enemyBullets)
+    void Resolve()
+    {
+        for (const DamageEvent& e : events)
+        {
+            // Gone already, or something earlier in the queue already killed it
+            GameObject* target = entities.Resolve(e.target);
+            if (target == nullptr || !target->alive) continue;
+
+            target->TakeDamage(e.amount);
+            bool killed = target->health <= 0;
+            if (killed) target->OnDeath();
+            for (auto& listener : listeners)
             {
-                b->Draw();
+                listener(e, target, killed);
             }
         }
+        events.clear();
+    }
+
+private:
+    std::vector<DamageEvent> events;
+};
 
-        // 0 = player, 1 = enemy
-        int getBulletCount(int type)
+
+// A target found by TargetBVH. handle is null if nothing matched
+struct TargetHit
+{
+    EntityHandle handle;
+    sf::Vector2f position; // Centre of its AABB when the tree was last updated
+    float distanceSq = 0;
+};
+
+// Where a homing bullet or auto-aim is looking from, and which way
+struct ConeQuery
+{
+    sf::Vector2f from;
+    sf::Vector2f dir; // Normalized
+};
+
+// Bounding volume hierarchy over the AABBs of things that can be targeted (enemies). Updated once per tick,
+// after which any number of nearest-target queries only look at the few boxes near them instead of every
+// enemy. Refits the existing tree while the same objects are alive, and rebuilds it when that changes or
+// every REBUILD_INTERVAL updates (refitting slowly makes the tree worse as things move around)
+class TargetBVH
+{
+public:
+    static const int LEAF_SIZE = 4;
+    static const int REBUILD_INTERVAL = 30;
+    static const int MAX_K = 16;
+
+    WORLD_GROUP targetGroup = WORLD_GROUP::ENEMY; // Anything else in the list (pickups) is left out
+
+    // objects: anything deriving from GameObject. Dead ones are left out
+    template <typename T>
+    void Update(const std::vector<T*>& objects)
+    {
+        int aliveCount = 0;
+        for (T* o : objects) if (IsTarget(o)) aliveCount++;
+
+        bool rebuild = aliveCount != (int)items.size() || ++sinceRebuild >= REBUILD_INTERVAL || !Refit();
+        if (!rebuild) return;
+
+        items.clear();
+        for (T* o : objects)
         {
-            if (type == 0) return playerBullets.size();
-            else if (type == 1) return enemyBullets.size();
-            else return -1;
+            if (!IsTarget(o)) continue;
+            items.push_back(Item{ o->handle, o->getAABB(), Center(o->getAABB()) });
         }
-        // collectionId: 0=player, 1= enemy
-        int addBullet(int collectionId, Bullet* b)
+        nodes.clear();
+        if (!items.empty())
         {
-            if (collectionId == 0) playerBullets.push_back(b);
-            else if (collectionId == 1) enemyBullets.push_back(b);
-            else return -1;
-            return 0;
+            nodes.push_back(Node());
+            Build(0, 0, (int)items.size());
         }
+        sinceRebuild = 0;
+    }
 
-        void UpdateBullets(std::vector<Bullet*>& collection, float dt)
-        {
-            for (auto it = collection.begin(); it != collection.end(); /* no increment here */) {
-                int result = (*it)->Update(dt); // Update now returns int
-                if (result == -1) { // Delete bullets that return -1 (delete flag)
-                    (*it)->grid->RemoveFromPartitions((*it), (*it)->gridPartitions);
+    int size() const { return (int)items.size(); }
 
-                    it = collection.erase(it); // erase returns the next valid iterator
-                }
-                else {
-                    ++it; // only increment if not erased
+    bool IsTarget(const GameObject* o) const { return o->alive && o->group == targetGroup; }
+
+    // Closest target whose centre is within maxDistance and inside the cone around q.dir.
+    // cosHalfAngle is the cosine of half the cone's opening angle (-1 for any direction)
+    TargetHit NearestInCone(const ConeQuery& q, float cosHalfAngle, float maxDistance) const
+    {
+        TargetHit best;
+        best.distanceSq = maxDistance * maxDistance;
+        if (nodes.empty()) return best;
+
+        int stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0)
+        {
+            const Node& node = nodes[stack[--top]];
+            if (DistanceSq(q.from, node.box) > best.distanceSq) continue;
+            if (node.count > 0)
+            {
+                for (int i = node.first; i < node.first + node.count; i++)
+                {
+                    const Item& item = items[i];
+                    sf::Vector2f d = item.center - q.from;
+                    float dd = d.x * d.x + d.y * d.y;
+                    if (!Closer(dd, item.handle, best)) continue;
+                    if (d.x * q.dir.x + d.y * q.dir.y < cosHalfAngle * std::sqrt(dd)) continue;
+                    best = TargetHit{ item.handle, item.center, dd };
                 }
+                continue;
             }
+            // Nearer child goes on top so it is searched first and tightens the bound sooner
+            int a = node.first, b = node.first + 1;
+            if (DistanceSq(q.from, nodes[a].box) < DistanceSq(q.from, nodes[b].box)) std::swap(a, b);
+            stack[top++] = a;
+            stack[top++] = b;
         }
+        return best;
+    }
 
-        int Update(float dt)
-        {
-            UpdateBullets(playerBullets, dt);
-            UpdateBullets(enemyBullets, dt);
-            // Check for collisions
-
-            return 0;
-        }
+    // Many NearestInCone queries at once. out gets one hit per query, in the same order
+    void NearestInCone(const std::vector<ConeQuery>& queries, float cosHalfAngle, float maxDistance, std::vector<TargetHit>& out) const
+    {
+        out.resize(queries.size());
+        for (int i = 0; i < (int)queries.size(); i++) out[i] = NearestInCone(queries[i], cosHalfAngle, maxDistance);
+    }
 
-        void Init(Grid* g, GameObject* p)
+    // Up to k (at most MAX_K) closest targets within maxDistance, closest first. Returns how many were found
+    int KNearest(sf::Vector2f from, int k, float maxDistance, TargetHit* out) const
+    {
+        k = k > MAX_K ? (int)MAX_K : k;
+        int found = 0;
+        if (nodes.empty() || k <= 0) return 0;
+
+        float bound = maxDistance * maxDistance;
+        int stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0)
         {
-            this->grid = g;
-            this->player = p;
-            playerBullets.clear();
-            //std::vector<Bullet*> enemyBullets;
+            const Node& node = nodes[stack[--top]];
+            if (DistanceSq(from, node.box) > bound) continue;
+            if (node.count > 0)
+            {
+                for (int i = node.first; i < node.first + node.count; i++)
+                {
+                    const Item& item = items[i];
+                    sf::Vector2f d = item.center - from;
+                    float dd = d.x * d.x + d.y * d.y;
+                    if (dd > bound) continue;
+                    // Insertion sort into the results, dropping the furthest once there are k
+                    int at;
+                    if (found < k) at = found++;
+                    else if (Closer(dd, item.handle, out[k - 1])) at = k - 1;
+                    else continue;
+                    while (at > 0 && Closer(dd, item.handle, out[at - 1]))
+                    {
+                        out[at] = out[at - 1];
+                        at--;
+                    }
+                    out[at] = TargetHit{ item.handle, item.center, dd };
+                    if (found == k) bound = out[k - 1].distanceSq;
+                }
+                continue;
+            }
+            int a = node.first, b = node.first + 1;
+            if (DistanceSq(from, nodes[a].box) < DistanceSq(from, nodes[b].box)) std::swap(a, b);
+            stack[top++] = a;
+            stack[top++] = b;
         }
-};
+        return found;
+    }
+
+    // Many KNearest queries at once. Query i's hits are out[i * k] onwards, closest first, and counts[i] says how many
+    void KNearest(const std::vector<sf::Vector2f>& from, int k, float maxDistance, std::vector<TargetHit>& out, std::vector<int>& counts) const
+    {
+        k = k > MAX_K ? (int)MAX_K : (k < 0 ? 0 : k);
+        out.resize(from.size() * k);
+        counts.resize(from.size());
+        for (int i = 0; i < (int)from.size(); i++) counts[i] = KNearest(from[i], k, maxDistance, out.data() + i * k);
+    }
 
-class Player : public GridGameObject
-{
 private:
-    sf::Vector2f lastDir = sf::Vector2f(0, -1);
+    struct Item
+    {
+        EntityHandle handle;
+        AABB box;
+        sf::Vector2f center;
+    };
 
-public:
-    float r_Size = 48; // pixels
-    sf::Angle gunRot;
-    const float movSpd = 300.0f;
-    const float strafeSpd = 300.0f;
-    BulletManager* bulletManager;
-    //std::vector<Bullet*> bullets;
+    // Leaf if count > 0: items [first, first + count). Otherwise children are nodes first and first + 1
+    struct Node
+    {
+        AABB box;
+        int first;
+        int count;
+    };
 
-    std::string debugInfo() override
+    std::vector<Item> items;
+    std::vector<Node> nodes;
+    int sinceRebuild = 0;
+
+    static sf::Vector2f Center(const AABB& b)
     {
-        return "Player";
+        return sf::Vector2f{ (b.minX + b.maxX) / 2, (b.minY + b.maxY) / 2 };
     }
 
-    void Init(Grid* g, BulletManager* b)
+    static AABB Union(const AABB& a, const AABB& b)
     {
-        this->group = WORLD_GROUP::PLAYER;
-        this->setCollisionAs_Box(r_Size, r_Size, COLLISIONBOXORIGIN::CENTER);
-        this->bulletManager = b;
-        this->tag = GAMETAG::PLAYER;
-        GridGameObject::Init(g);
-        
-        setPosition(sf::Vector2f({ SCREEN_WIDTH / 2, SCREEN_HEIGHT / 2 }));
-        gunRot = sf::degrees(360);
-        std::cout << "Bulletmanager is null? " << (bulletManager == nullptr) << "\n";
+        return AABB{ std::min(a.minX, b.minX), std::max(a.maxX, b.maxX), std::min(a.minY, b.minY), std::max(a.maxY, b.maxY) };
     }
 
-    int Update(float dt) override
+    // 0 if p is inside the box
+    static float DistanceSq(sf::Vector2f p, const AABB& b)
     {
-        float inputX = 0;
-        float inputY = 0;
-        if (sf::Keyboard::isKeyPressed(sf::Keyboard::Key::Right)) {
-            inputX += 1;
-        }
-        if (sf::Keyboard::isKeyPressed(sf::Keyboard::Key::Left)) {
-            inputX -= 1;
-        }
-        if (sf::Keyboard::isKeyPressed(sf::Keyboard::Key::Down)) {
-            inputY += 1;
-        }
-        if (sf::Keyboard::isKeyPressed(sf::Keyboard::Key::Up)) {
-            inputY -= 1;
-        }
+        float dx = std::max({ b.minX - p.x, 0.0f, p.x - b.maxX });
+        float dy = std::max({ b.minY - p.y, 0.0f, p.y - b.maxY });
+        return dx * dx + dy * dy;
+    }
 
-        // Normalize it
-        sf::Vector2f input = sf::Vector2f(inputX, inputY);
-        if (input.length() > 0)
+    // Equal distances go to the lower handle, so the answer doesn't depend on the shape of the tree
+    static bool Closer(float dd, EntityHandle h, const TargetHit& than)
+    {
+        if (dd != than.distanceSq) return dd < than.distanceSq;
+        return than.handle.isNull() || h.value < than.handle.value;
+    }
+
+    // Fills in node index as the subtree over items [begin, end). Splits at the median centre along the longer axis
+    void Build(int index, int begin, int end)
+    {
+        AABB box = items[begin].box;
+        AABB centers{ items[begin].center.x, items[begin].center.x, items[begin].center.y, items[begin].center.y };
+        for (int i = begin + 1; i < end; i++)
         {
-            input = input.normalized();
-            float _spd = 0;
+            box = Union(box, items[i].box);
+            sf::Vector2f c = items[i].center;
+            centers = Union(centers, AABB{ c.x, c.x, c.y, c.y });
+        }
 
-            // Not Strafing
-            if (sf::Keyboard::isKeyPressed(Keybindings::STRAFE)) _spd = strafeSpd;
-            else { _spd = movSpd, lastDir = input; }
-            //std::cout << "Input: " << input.x << ", " << input.y << "\n";
-            setPosition(getPosition() + (input * (_spd * dt)));
+        if (end - begin <= LEAF_SIZE)
+        {
+            nodes[index] = Node{ box, begin, end - begin };
+            return;
         }
 
-        // Run update on any bullets
-        
-        
-        return 0;
-    }
-    
-    void OnFireButtonPress()
-    {
-        // spawn bullet
-        //Bullet* b = new Bullet(lastDir, , bulletManager->getBulletCount(0), grid, std::vector<COLLISION_LAYER>{COLLISION_LAYER::ENEMY}, this);
-        bulletManager->createBullet(0, getPosition(), lastDir, this);
-        //bulletManager->addBullet(0, b); 
+        bool alongX = centers.maxX - centers.minX >= centers.maxY - centers.minY;
+        int mid = (begin + end) / 2;
+        std::nth_element(items.begin() + begin, items.begin() + mid, items.begin() + end, [alongX](const Item& a, const Item& b)
+            {
+                return alongX ? a.center.x < b.center.x : a.center.y < b.center.y;
+            });
+
+        // Children sit next to each other, so a node only needs the index of the first
+        int first = (int)nodes.size();
+        nodes.push_back(Node());
+        nodes.push_back(Node());
+        nodes[index] = Node{ box, first, 0 };
+        Build(first, begin, mid);
+        Build(first + 1, mid, end);
     }
 
-    /*
-    void DrawBullets()
+    // Moves the boxes to where the objects are now. Returns false if one of them is gone, then it needs a rebuild
+    bool Refit()
     {
-        for (auto& b : bullets)
+        for (Item& item : items)
         {
-            b->Draw();
+            GameObject* g = entities.Resolve(item.handle);
+            if (g == nullptr || !g->alive) return false;
+            item.box = g->getAABB();
+            item.center = Center(item.box);
         }
-    }*/
+        // Children always come after their parent, so going backwards fixes them up before the parent
+        for (int i = (int)nodes.size() - 1; i >= 0; i--)
+        {
+            Node& node = nodes[i];
+            if (node.count > 0)
+            {
+                node.box = items[node.first].box;
+                for (int j = node.first + 1; j < node.first + node.count; j++) node.box = Union(node.box, items[j].box);
+            }
+            else node.box = Union(nodes[node.first].box, nodes[node.first + 1].box);
+        }
+        return true;
+    }
+};
 
-    void Draw()
+// Something a Broadphase can find: a box, whose it is and which WORLD_GROUP that is in
+struct BroadphaseItem
+{
+    EntityHandle handle;
+    AABB box;
+    WORLD_GROUP group;
+};
+
+inline unsigned GroupBit(WORLD_GROUP group) { return 1u << static_cast<int>(group); }
+
+inline const char* GroupName(WORLD_GROUP group)
+{
+    static const char* names[] = { "player", "enemy", "wall", "bullet", "other" };
+    return names[static_cast<int>(group)];
+}
+
+// What a broadphase did, counted rather than timed so backends can be compared the same way on any machine
+struct BroadphaseStats
+{
+    long long queries = 0;
+    long long tests = 0; // Item boxes tested against a query
+    long long visits = 0; // Cells or nodes looked at
+    long long results = 0;
+    long long updateWork = 0; // Cells written, nodes built or sort steps
+
+    // How the items were spread out at the last Update. Buckets are cells, leaves or (sweep and prune) one list
+    int items = 0;
+    int buckets = 0;
+    int occupied = 0;
+    int maxPerBucket = 0;
+
+    long long QueryWork() const { return tests + visits; }
+
+    void ResetWork()
     {
-        // Draw player
-        sf::RectangleShape r = sf::RectangleShape(sf::Vector2f({ r_Size, r_Size }));
-        r.setFillColor(sf::Color::Red);
-        //r.setOutlineThickness(2.0f);
-        r.setOrigin(sf::Vector2f({ r_Size / 2, r_Size / 2 }));
-        r.setPosition(getPosition());
-        window->draw(r);
+        queries = tests = visits = results = updateWork = 0;
+    }
+};
 
-        // Draw gun
-        sf::RectangleShape gun = sf::RectangleShape(sf::Vector2f({ 10, 48 }));
-        gun.setFillColor(sf::Color::Black);
-        gun.setOrigin(sf::Vector2f({ 5,0 }));
-        gun.setPosition(getPosition());
-        gun.setRotation(sf::radians(-3.14159265f / 2 + std::atan2(lastDir.y, lastDir.x)));
-        window->draw(gun);
+// Finds which items a query could touch without looking at every one. All backends give the same results:
+// everything in groupMask whose box the query touches, each once, in no particular order. They only differ in
+// how much work that takes for a given layout
+class Broadphase
+{
+public:
+    BroadphaseStats stats;
+
+    virtual ~Broadphase() {}
+    virtual const char* Name() const = 0;
+
+    // The room. Items may stick out of it
+    virtual void SetBounds(float width, float height)
+    {
+        roomWidth = width;
+        roomHeight = height;
+    }
+
+    // Replaces every item with these
+    virtual void Update(const std::vector<BroadphaseItem>& items) = 0;
+    // Appends everything in groupMask whose box the segment from a to b touches
+    virtual void QuerySegment(sf::Vector2f a, sf::Vector2f b, unsigned groupMask, std::vector<EntityHandle>& out) = 0;
+    // Appends everything in groupMask whose box overlaps box
+    virtual void QueryBox(const AABB& box, unsigned groupMask, std::vector<EntityHandle>& out) = 0;
+
+protected:
+    float roomWidth = 0;
+    float roomHeight = 0;
+
+    static bool SegmentTouches(sf::Vector2f a, sf::Vector2f d, const AABB& box)
+    {
+        float t0 = 0;
+        float t1 = 1;
+        return ClipToSlab(a.x, d.x, box.minX, box.maxX, t0, t1) && ClipToSlab(a.y, d.y, box.minY, box.maxY, t0, t1);
+    }
 
+    static AABB SegmentBox(sf::Vector2f a, sf::Vector2f b)
+    {
+        return AABB{ std::min(a.x, b.x), std::max(a.x, b.x), std::min(a.y, b.y), std::max(a.y, b.y) };
+    }
 
+    // The room grown to fit every item, so nothing sticking out of it can be missed
+    AABB ItemBounds(const std::vector<BroadphaseItem>& items) const
+    {
+        AABB bounds{ 0, roomWidth, 0, roomHeight };
+        for (const BroadphaseItem& item : items)
+        {
+            bounds.minX = std::min(bounds.minX, item.box.minX);
+            bounds.maxX = std::max(bounds.maxX, item.box.maxX);
+            bounds.minY = std::min(bounds.minY, item.box.minY);
+            bounds.maxY = std::max(bounds.maxY, item.box.maxY);
+        }
+        return bounds;
+    }
 
+    // Tests one item and appends it if the query matches
+    void Test(const BroadphaseItem& item, unsigned groupMask, bool hit, std::vector<EntityHandle>& out)
+    {
+        stats.tests++;
+        if (hit && (groupMask & GroupBit(item.group)) != 0)
+        {
+            out.push_back(item.handle);
+            stats.results++;
+        }
     }
 };
-class Enemy : public GridGameObject
+
+// Square cells of cellSize, rebuilt every Update. Items go in every cell they cover, stored cell after cell in
+// one array. Best when things are spread evenly and the cell size suits how big they are and how far a query reaches
+class UniformGridBroadphase : public Broadphase
 {
 public:
-    float r_Size = 64;
-    GAMETAG tag = GAMETAG::ENEMY;
-    float y_center;
-    Player* player;
-    BulletManager* bulletManager;
+    UniformGridBroadphase(float size) : cellSize(size), name("grid" + std::to_string((int)size)) {}
 
+    const char* Name() const override { return name.c_str(); }
 
-    float y;
-    float _timer;
-    float fireTimer; // counter
+    void Update(const std::vector<BroadphaseItem>& newItems) override
+    {
+        items = newItems;
+        bounds = ItemBounds(items);
+        cols = std::max(1, (int)std::ceil((bounds.maxX - bounds.minX) / cellSize));
+        rows = std::max(1, (int)std::ceil((bounds.maxY - bounds.minY) / cellSize));
+        cellW = std::max(1.0f, (bounds.maxX - bounds.minX) / cols);
+        cellH = std::max(1.0f, (bounds.maxY - bounds.minY) / rows);
+
+        // Count how many go in each cell, then fill them in
+        cellStart.assign(cols * rows + 1, 0);
+        for (const BroadphaseItem& item : items) ForCells(item.box, [&](int cell) { cellStart[cell + 1]++; });
+        for (int i = 0; i < cols * rows; i++) cellStart[i + 1] += cellStart[i];
+        cellItems.resize(cellStart.back());
+        fill.assign(cellStart.begin(), cellStart.end() - 1);
+        for (int i = 0; i < (int)items.size(); i++) ForCells(items[i].box, [&](int cell) { cellItems[fill[cell]++] = i; });
+        seen.assign(items.size(), 0);
+        stamp = 0;
+
+        stats.updateWork += (long long)cellItems.size() + cols * rows;
+        stats.items = (int)items.size();
+        stats.buckets = cols * rows;
+        stats.occupied = 0;
+        stats.maxPerBucket = 0;
+        for (int i = 0; i < cols * rows; i++)
+        {
+            int count = cellStart[i + 1] - cellStart[i];
+            if (count > 0) stats.occupied++;
+            stats.maxPerBucket = std::max(stats.maxPerBucket, count);
+        }
+    }
 
+    void QuerySegment(sf::Vector2f a, sf::Vector2f b, unsigned groupMask, std::vector<EntityHandle>& out) override
+    {
+        stats.queries++;
+        NextStamp();
+        sf::Vector2f d = b - a;
+        float t0 = 0;
+        float t1 = 1;
+        if (!ClipToSlab(a.x, d.x, bounds.minX, bounds.maxX, t0, t1) || !ClipToSlab(a.y, d.y, bounds.minY, bounds.maxY, t0, t1)) return;
+
+        sf::Vector2f start = a + d * t0 - sf::Vector2f{ bounds.minX, bounds.minY };
+        sf::Vector2f end = a + d * t1 - sf::Vector2f{ bounds.minX, bounds.minY };
+        int x = std::clamp((int)std::floor(start.x / cellW), 0, cols - 1);
+        int y = std::clamp((int)std::floor(start.y / cellH), 0, rows - 1);
+        int endX = std::clamp((int)std::floor(end.x / cellW), 0, cols - 1);
+        int endY = std::clamp((int)std::floor(end.y / cellH), 0, rows - 1);
+
+        // Walk cell to cell, always crossing whichever border the segment reaches first
+        const float NEVER = std::numeric_limits<float>::infinity();
+        float ax = a.x - bounds.minX;
+        float ay = a.y - bounds.minY;
+        int stepX = d.x > 0 ? 1 : (d.x < 0 ? -1 : 0);
+        int stepY = d.y > 0 ? 1 : (d.y < 0 ? -1 : 0);
+        float nextX = stepX > 0 ? ((x + 1) * cellW - ax) / d.x : (stepX < 0 ? (x * cellW - ax) / d.x : NEVER);
+        float nextY = stepY > 0 ? ((y + 1) * cellH - ay) / d.y : (stepY < 0 ? (y * cellH - ay) / d.y : NEVER);
+        float deltaX = stepX != 0 ? cellW / std::abs(d.x) : NEVER;
+        float deltaY = stepY != 0 ? cellH / std::abs(d.y) : NEVER;
+
+        while (true)
+        {
+            int cell = y * cols + x;
+            stats.visits++;
+            for (int k = cellStart[cell]; k < cellStart[cell + 1]; k++)
+            {
+                int i = cellItems[k];
+                if (seen[i] == stamp) continue;
+                seen[i] = stamp;
+                Test(items[i], groupMask, SegmentTouches(a, d, items[i].box), out);
+            }
 
-    // Settings
-    float amplitude = 200;
-    float timeScale = 1;
-    float fireWaitTime = 0.1f; // Seconds
-    float distanceToFire = 85;
+            if (x == endX && y == endY) break;
+            if (nextX < nextY)
+            {
+                if (nextX > t1) break;
+                x += stepX;
+                nextX += deltaX;
+            }
+            else
+            {
+                if (nextY > t1) break;
+                y += stepY;
+                nextY += deltaY;
+            }
+            if (x < 0 || x >= cols || y < 0 || y >= rows) break;
+        }
+    }
 
+    void QueryBox(const AABB& box, unsigned groupMask, std::vector<EntityHandle>& out) override
+    {
+        stats.queries++;
+        NextStamp();
+        if (!box.overlaps(bounds)) return;
+        ForCells(box, [&](int cell)
+            {
+                stats.visits++;
+                for (int k = cellStart[cell]; k < cellStart[cell + 1]; k++)
+                {
+                    int i = cellItems[k];
+                    if (seen[i] == stamp) continue;
+                    seen[i] = stamp;
+                    Test(items[i], groupMask, items[i].box.overlaps(box), out);
+                }
+            });
+    }
 
-    void Init(Grid* g, sf::Vector2f startPos, Player* _player, BulletManager* b)
+private:
+    float cellSize;
+    std::string name;
+    std::vector<BroadphaseItem> items;
+    AABB bounds;
+    int cols = 1;
+    int rows = 1;
+    float cellW = 1;
+    float cellH = 1;
+    std::vector<int> cellStart; // Items of cell i are cellItems[cellStart[i]] up to cellItems[cellStart[i + 1]]
+    std::vector<int> cellItems;
+    std::vector<int> fill;
+    std::vector<unsigned> seen; // Items cover several cells, this stops them being returned twice
+    unsigned stamp = 0;
+
+    void NextStamp()
     {
-        this->group = WORLD_GROUP::ENEMY;
-        this->setCollisionAs_Box(r_Size, r_Size, COLLISIONBOXORIGIN::CENTER);
-        bulletManager = b;
-        player = _player;
-        GridGameObject::Init(g);
-        setPosition(startPos);
-        y_center = getPosition().y;
-        y = y_center;
-        _timer = 0;
-        fireTimer = fireWaitTime; // Allowed to fire immediately
+        if (++stamp == 0)
+        {
+            std::fill(seen.begin(), seen.end(), 0);
+            stamp = 1;
+        }
     }
 
-    std::string debugInfo() { return "Enemy"; }
+    template <typename F>
+    void ForCells(const AABB& box, F f)
+    {
+        int x0 = std::clamp((int)std::floor((box.minX - bounds.minX) / cellW), 0, cols - 1);
+        int x1 = std::clamp((int)std::floor((box.maxX - bounds.minX) / cellW), 0, cols - 1);
+        int y0 = std::clamp((int)std::floor((box.minY - bounds.minY) / cellH), 0, rows - 1);
+        int y1 = std::clamp((int)std::floor((box.maxY - bounds.minY) / cellH), 0, rows - 1);
+        for (int y = y0; y <= y1; y++)
+            for (int x = x0; x <= x1; x++) f(y * cols + x);
+    }
+};
 
+// Items kept sorted by the left edge of their box. Between updates things only move a little, so an insertion
+// sort puts the list back in order in about one pass. A query only looks at the items whose left edge is in
+// reach of it. Needs no tuning, and costs little to update when there are few queries
+class SweepAndPruneBroadphase : public Broadphase
+{
+public:
+    const char* Name() const override { return "sap"; }
 
-    virtual void Draw()
+    void Update(const std::vector<BroadphaseItem>& items) override
     {
-        sf::RectangleShape r = sf::RectangleShape(sf::Vector2f({ r_Size, r_Size }));
-        r.setFillColor(sf::Color::Yellow);
-        //r.setOutlineThickness(2.0f);
-        r.setOrigin(sf::Vector2f({ r_Size / 2, r_Size / 2 }));
-        r.setPosition(getPosition());
-        window->draw(r);
+        // Keep each item where it was in the sorted list if it was there last time. New ones go on the end
+        stamp++;
+        int added = 0;
+        for (const BroadphaseItem& item : items)
+        {
+            std::uint32_t index = item.handle.index();
+            if (index < slotOf.size() && slotOf[index] < sorted.size() && sorted[slotOf[index]].item.handle == item.handle)
+            {
+                Entry& entry = sorted[slotOf[index]];
+                entry.item = item;
+                entry.stamp = stamp;
+            }
+            else
+            {
+                sorted.push_back(Entry{ item, stamp });
+                added++;
+            }
+        }
+        std::erase_if(sorted, [&](const Entry& e) { return e.stamp != stamp; });
+
+        // Items that were already there have only moved a little, insertion sort is close to one pass for those.
+        // New ones (all of them, the first time) would make it quadratic, so they are sorted on their own and merged in
+        int kept = (int)sorted.size() - added;
+        for (int i = 1; i < kept; i++)
+        {
+            Entry moving = sorted[i];
+            int j = i - 1;
+            while (j >= 0 && Before(moving, sorted[j]))
+            {
+                sorted[j + 1] = sorted[j];
+                j--;
+                stats.updateWork++;
+            }
+            sorted[j + 1] = moving;
+        }
+        if (added > 0)
+        {
+            std::sort(sorted.begin() + kept, sorted.end(), Before);
+            std::inplace_merge(sorted.begin(), sorted.begin() + kept, sorted.end(), Before);
+            stats.updateWork += (long long)(added * std::log2(added + 1));
+        }
+
+        maxWidth = 0;
+        for (std::uint32_t i = 0; i < sorted.size(); i++)
+        {
+            std::uint32_t index = sorted[i].item.handle.index();
+            if (index >= slotOf.size()) slotOf.resize(index + 1, ~0u);
+            slotOf[index] = i;
+            maxWidth = std::max(maxWidth, sorted[i].item.box.maxX - sorted[i].item.box.minX);
+        }
 
+        stats.updateWork += (long long)sorted.size();
+        stats.items = (int)sorted.size();
+        stats.buckets = 1;
+        stats.occupied = sorted.empty() ? 0 : 1;
+        stats.maxPerBucket = (int)sorted.size();
     }
 
-    int Update(float dt) override
+    void QuerySegment(sf::Vector2f a, sf::Vector2f b, unsigned groupMask, std::vector<EntityHandle>& out) override
     {
-        //std::cout << "In enemy update\n";
-        y = y_center + amplitude*std::sin(_timer*timeScale);
-        this->setPosition(sf::Vector2f{ getPosition().x, y });
-        
-        if (std::abs(y - player->getPosition().y) <= distanceToFire && fireTimer >= fireWaitTime)
+        stats.queries++;
+        AABB box = SegmentBox(a, b);
+        sf::Vector2f d = b - a;
+        Scan(box, [&](const BroadphaseItem& item) { Test(item, groupMask, item.box.overlaps(box) && SegmentTouches(a, d, item.box), out); });
+    }
+
+    void QueryBox(const AABB& box, unsigned groupMask, std::vector<EntityHandle>& out) override
+    {
+        stats.queries++;
+        Scan(box, [&](const BroadphaseItem& item) { Test(item, groupMask, item.box.overlaps(box), out); });
+    }
+
+private:
+    struct Entry
+    {
+        BroadphaseItem item;
+        unsigned stamp;
+    };
+
+    std::vector<Entry> sorted;
+    std::vector<std::uint32_t> slotOf; // Handle index -> place in sorted at the last Update
+    unsigned stamp = 0;
+    float maxWidth = 0;
+
+    static bool Before(const Entry& a, const Entry& b)
+    {
+        if (a.item.box.minX != b.item.box.minX) return a.item.box.minX < b.item.box.minX;
+        return a.item.handle.value < b.item.handle.value;
+    }
+
+    // Calls f for every item whose left edge is between box.minX - maxWidth and box.maxX
+    template <typename F>
+    void Scan(const AABB& box, F f)
+    {
+        float from = box.minX - maxWidth;
+        int i = (int)(std::lower_bound(sorted.begin(), sorted.end(), from, [](const Entry& e, float x) { return e.item.box.minX < x; }) - sorted.begin());
+        stats.visits++;
+        for (; i < (int)sorted.size() && sorted[i].item.box.minX <= box.maxX; i++) f(sorted[i].item);
+    }
+};
+
+// Splits space into quarters wherever more than CAPACITY items are, so clusters get small nodes and empty space
+// stays one big one. Loose: a node accepts anything whose centre is in its quarter and that fits in the quarter
+// grown by half its size on every side, so small things on a dividing line don't all pile up near the root.
+// Rebuilt every Update
+class QuadtreeBroadphase : public Broadphase
+{
+public:
+    static const int CAPACITY = 8;
+    static const int MAX_DEPTH = 8;
+
+    const char* Name() const override { return "quadtree"; }
+
+    void Update(const std::vector<BroadphaseItem>& newItems) override
+    {
+        items = newItems;
+        nodes.clear();
+        nodes.push_back(MakeNode(ItemBounds(items)));
+        nodes[0].loose = nodes[0].bounds; // Everything is inside the root already
+        Build(0, 0, (int)items.size(), 0);
+
+        stats.updateWork += (long long)nodes.size() + (long long)items.size();
+        stats.items = (int)items.size();
+        stats.buckets = (int)nodes.size();
+        stats.occupied = 0;
+        stats.maxPerBucket = 0;
+        for (const Node& node : nodes)
         {
-            Fire();
+            if (node.count > 0) stats.occupied++;
+            stats.maxPerBucket = std::max(stats.maxPerBucket, node.count);
         }
-        else fireTimer += dt;
-        
+    }
+
+    void QuerySegment(sf::Vector2f a, sf::Vector2f b, unsigned groupMask, std::vector<EntityHandle>& out) override
+    {
+        stats.queries++;
+        sf::Vector2f d = b - a;
+        Walk([&](const AABB& box) { return SegmentTouches(a, d, box); }, groupMask, out);
+    }
+
+    void QueryBox(const AABB& box, unsigned groupMask, std::vector<EntityHandle>& out) override
+    {
+        stats.queries++;
+        Walk([&](const AABB& other) { return other.overlaps(box); }, groupMask, out);
+    }
+
+private:
+    struct Node
+    {
+        AABB bounds; // This node's quarter
+        AABB loose; // Everything in it is inside this
+        int first = 0; // Items that don't fit in one child are items[first] to items[first + count - 1]
+        int count = 0;
+        int firstChild = -1; // Four children in a row, -1 for a leaf
+    };
+
+    static Node MakeNode(const AABB& bounds)
+    {
+        float growX = (bounds.maxX - bounds.minX) / 2;
+        float growY = (bounds.maxY - bounds.minY) / 2;
+        return Node{ bounds, AABB{ bounds.minX - growX, bounds.maxX + growX, bounds.minY - growY, bounds.maxY + growY } };
+    }
+
+    std::vector<BroadphaseItem> items;
+    std::vector<Node> nodes;
+
+    // Which quarter of bounds the box's centre is in, -1 if it is too big for that quarter's loose bounds
+    static int Quadrant(const AABB& bounds, const AABB& box)
+    {
+        float cx = (bounds.minX + bounds.maxX) / 2;
+        float cy = (bounds.minY + bounds.maxY) / 2;
+        float quarterW = (bounds.maxX - bounds.minX) / 4; // How far the loose bounds of a quarter reach past it
+        float quarterH = (bounds.maxY - bounds.minY) / 4;
+        float x = (box.minX + box.maxX) / 2;
+        float y = (box.minY + box.maxY) / 2;
+        int q = (y < cy ? 0 : 2) + (x < cx ? 0 : 1);
+        float minX = x < cx ? bounds.minX : cx;
+        float minY = y < cy ? bounds.minY : cy;
+        float maxX = x < cx ? cx : bounds.maxX;
+        float maxY = y < cy ? cy : bounds.maxY;
+        bool fits = box.minX >= minX - quarterW && box.maxX <= maxX + quarterW && box.minY >= minY - quarterH && box.maxY <= maxY + quarterH;
+        return fits ? q : -1;
+    }
+
+    void Build(int index, int begin, int end, int depth)
+    {
+        nodes[index].first = begin;
+        nodes[index].count = end - begin;
+        if (end - begin <= CAPACITY || depth >= MAX_DEPTH) return;
+
+        // Items crossing the middle stay here, the rest are grouped by quarter
+        AABB bounds = nodes[index].bounds;
+        int split[5];
+        split[0] = (int)(std::partition(items.begin() + begin, items.begin() + end, [&](const BroadphaseItem& item) { return Quadrant(bounds, item.box) < 0; }) - items.begin());
+        for (int q = 0; q < 4; q++)
+        {
+            split[q + 1] = (int)(std::partition(items.begin() + split[q], items.begin() + end, [&](const BroadphaseItem& item) { return Quadrant(bounds, item.box) == q; }) - items.begin());
+        }
+        if (split[0] == end) return; // Nothing fits lower down
+
+        nodes[index].count = split[0] - begin;
+        int firstChild = (int)nodes.size();
+        nodes[index].firstChild = firstChild;
+        float cx = (bounds.minX + bounds.maxX) / 2;
+        float cy = (bounds.minY + bounds.maxY) / 2;
+        nodes.push_back(MakeNode(AABB{ bounds.minX, cx, bounds.minY, cy }));
+        nodes.push_back(MakeNode(AABB{ cx, bounds.maxX, bounds.minY, cy }));
+        nodes.push_back(MakeNode(AABB{ bounds.minX, cx, cy, bounds.maxY }));
+        nodes.push_back(MakeNode(AABB{ cx, bounds.maxX, cy, bounds.maxY }));
+        for (int q = 0; q < 4; q++) Build(firstChild + q, split[q], split[q + 1], depth + 1);
+    }
+
+    template <typename Touches>
+    void Walk(Touches touches, unsigned groupMask, std::vector<EntityHandle>& out)
+    {
+        if (nodes.empty()) return;
+        int stack[4 * MAX_DEPTH + 4];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0)
+        {
+            const Node& node = nodes[stack[--top]];
+            stats.visits++;
+            if (!touches(node.loose)) continue;
+            for (int i = node.first; i < node.first + node.count; i++) Test(items[i], groupMask, touches(items[i].box), out);
+            if (node.firstChild >= 0)
+            {
+                for (int q = 0; q < 4; q++) if (nodes[node.firstChild + q].count > 0 || nodes[node.firstChild + q].firstChild >= 0) stack[top++] = node.firstChild + q;
+            }
+        }
+    }
+};
+
+// Uses whichever backend suits how things are laid out at the moment. In the background it tries the other
+// candidates one small step per update: bring one up to date, time one update of it, then replay the most recent
+// queries on it a few at a time. Every TUNE_INTERVAL updates it compares what the active one actually did over
+// the interval with what each candidate would have done, and switches if one did clearly less work. Grids with
+// different cell sizes are separate candidates, which is how the cell size gets tuned. Work is counted, not
+// timed, so a run always makes the same choices
+class AdaptiveBroadphase : public Broadphase
+{
+public:
+    static const int TUNE_INTERVAL = 60;
+    static const int RECORDED_QUERIES = 256;
+    static const int REPLAY_PER_UPDATE = 64; // Recorded queries tried on a candidate per update
+
+    bool autoTune = true;
+    int switches = 0;
+    BroadphaseStats lastInterval; // The active backend's counters over the last TUNE_INTERVAL updates
+
+    AdaptiveBroadphase()
+    {
+        for (float size : { 32.0f, 64.0f, 128.0f, 256.0f }) candidates.push_back(std::make_unique<UniformGridBroadphase>(size));
+        candidates.push_back(std::make_unique<SweepAndPruneBroadphase>());
+        candidates.push_back(std::make_unique<QuadtreeBroadphase>());
+        active = candidates[2].get();
+        estimates.resize(candidates.size());
+        recorded.reserve(RECORDED_QUERIES);
+    }
+
+    const char* Name() const override { return active->Name(); }
+    Broadphase& Active() { return *active; }
+
+    // Only uses the backend with this name from now on. Returns false if there isn't one
+    bool Select(const std::string& name)
+    {
+        for (auto& candidate : candidates)
+        {
+            if (name != candidate->Name()) continue;
+            active = candidate.get();
+            autoTune = false;
+            return true;
+        }
+        return false;
+    }
+
+    void SetBounds(float width, float height) override
+    {
+        Broadphase::SetBounds(width, height);
+        for (auto& candidate : candidates) candidate->SetBounds(width, height);
+    }
+
+    void Update(const std::vector<BroadphaseItem>& items) override
+    {
+        active->Update(items);
+        if (autoTune) EvaluateStep(items);
+        if (++sinceTune < TUNE_INTERVAL) return;
+
+        lastInterval = active->stats;
+        if (autoTune) Tune();
+        active->stats.ResetWork();
+        sinceTune = 0;
+        evaluating = 0;
+        evaluationStep = 0;
+    }
+
+    void QuerySegment(sf::Vector2f a, sf::Vector2f b, unsigned groupMask, std::vector<EntityHandle>& out) override
+    {
+        Record(Query{ true, a, b, AABB(), groupMask });
+        active->QuerySegment(a, b, groupMask, out);
+    }
+
+    void QueryBox(const AABB& box, unsigned groupMask, std::vector<EntityHandle>& out) override
+    {
+        Record(Query{ false, sf::Vector2f(), sf::Vector2f(), box, groupMask });
+        active->QueryBox(box, groupMask, out);
+    }
+
+    // Same results, but neither recorded nor counted in the stats. For drawing and debug output, so what the
+    // camera looks at never decides which backend the simulation gets
+    void QueryBoxUntracked(const AABB& box, unsigned groupMask, std::vector<EntityHandle>& out)
+    {
+        BroadphaseStats counted = active->stats;
+        active->QueryBox(box, groupMask, out);
+        active->stats = counted;
+    }
+
+    void Report()
+    {
+        const BroadphaseStats& s = lastInterval;
+        double queries = std::max(1LL, s.queries);
+        std::cout << "[BROADPHASE]: " << active->Name() << (autoTune ? " (auto, " + std::to_string(switches) + " switches)" : std::string(" (fixed)"))
+            << ", " << s.items << " items in " << s.occupied << "/" << s.buckets << " buckets, at most " << s.maxPerBucket << " in one\n";
+        std::cout << "[BROADPHASE]: per tick " << (double)s.queries / TUNE_INTERVAL << " queries, " << (double)s.updateWork / TUNE_INTERVAL << " update work"
+            << ", per query " << s.tests / queries << " tests, " << s.visits / queries << " visits, " << s.results / queries << " results\n";
+    }
+
+private:
+    struct Query
+    {
+        bool segment;
+        sf::Vector2f a;
+        sf::Vector2f b;
+        AABB box;
+        unsigned groupMask;
+    };
+
+    // What one update and one query of a candidate cost when it was last tried. Only valid for this interval
+    struct Estimate
+    {
+        bool valid = false;
+        long long update = 0;
+        double perQuery = 0;
+    };
+
+    std::vector<std::unique_ptr<Broadphase>> candidates;
+    Broadphase* active;
+    std::vector<Estimate> estimates; // One per candidate
+    std::vector<Query> recorded; // Ring of the latest queries
+    int nextRecord = 0;
+    int sinceTune = 0;
+    int evaluating = 0; // Candidate being tried
+    int evaluationStep = 0; // 0: catch up, 1: measure an update, then replay REPLAY_PER_UPDATE queries a step
+    std::vector<EntityHandle> scratch;
+
+    void Record(const Query& q)
+    {
+        if ((int)recorded.size() < RECORDED_QUERIES) recorded.push_back(q);
+        else recorded[nextRecord] = q;
+        nextRecord = (nextRecord + 1) % RECORDED_QUERIES;
+    }
+
+    // One bounded piece of trying the next candidate, so no update costs much more than the one before
+    void EvaluateStep(const std::vector<BroadphaseItem>& items)
+    {
+        // The active one is measured for real, it doesn't need trying
+        if (evaluating < (int)candidates.size() && candidates[evaluating].get() == active) evaluating++;
+        if (evaluating >= (int)candidates.size()) return; // Tried them all this interval
+
+        Broadphase* candidate = candidates[evaluating].get();
+        Estimate& estimate = estimates[evaluating];
+        if (evaluationStep == 0)
+        {
+            // Sweep and prune may have a lot of sorting to catch up on since it was last used
+            candidate->Update(items);
+        }
+        else if (evaluationStep == 1)
+        {
+            candidate->stats.ResetWork();
+            candidate->Update(items);
+            estimate.update = candidate->stats.updateWork;
+            candidate->stats.ResetWork();
+        }
+        else
+        {
+            int first = (evaluationStep - 2) * REPLAY_PER_UPDATE;
+            int last = std::min(first + (int)REPLAY_PER_UPDATE, (int)recorded.size());
+            for (int i = first; i < last; i++)
+            {
+                const Query& q = recorded[i];
+                scratch.clear();
+                if (q.segment) candidate->QuerySegment(q.a, q.b, q.groupMask, scratch);
+                else candidate->QueryBox(q.box, q.groupMask, scratch);
+            }
+            if (last >= (int)recorded.size())
+            {
+                estimate.perQuery = recorded.empty() ? 0 : (double)candidate->stats.QueryWork() / recorded.size();
+                estimate.valid = true;
+                evaluating++;
+                evaluationStep = 0;
+                return;
+            }
+        }
+        evaluationStep++;
+    }
+
+    void Tune()
+    {
+        // What the active one really did, against what each candidate tried this interval would have
+        long long queriesSeen = active->stats.queries;
+        double activeCost = (double)active->stats.updateWork + active->stats.QueryWork();
+        Broadphase* best = active;
+        double bestCost = activeCost;
+        for (int i = 0; i < (int)candidates.size(); i++)
+        {
+            const Estimate& estimate = estimates[i];
+            if (!estimate.valid || candidates[i].get() == active) continue;
+            double cost = (double)estimate.update * TUNE_INTERVAL + estimate.perQuery * queriesSeen;
+            if (cost < bestCost)
+            {
+                best = candidates[i].get();
+                bestCost = cost;
+            }
+        }
+        for (Estimate& estimate : estimates) estimate.valid = false;
+
+        // Only switch for a clear win, so it doesn't flip back and forth between two that are about the same
+        if (best != active && bestCost < activeCost * 0.8)
+        {
+            active = best;
+            switches++;
+        }
+    }
+};
+
+class Bullet : public GridGameObject
+{
+
+public:
+    //static int count;
+    int id;
+    sf::Vector2f v;
+    EntityHandle owner;
+    std::vector<WORLD_GROUP> canDamage;
+    float bulletDamageAmount;
+    DamageQueue* damageQueue;
+    Broadphase* broadphase; // What Sweep looks things up in
+
+    // Scratch space for Sweep, so bullets don't allocate once these have grown. Per thread, like the entity table
+    static inline thread_local std::vector<EntityHandle> sweepCandidates;
+    static inline thread_local std::vector<EntityHandle> sweepHits;
+
+    // Settings
+
+    Bullet()
+    {
+        this->group = WORLD_GROUP::BULLET;
+        this->setCollisionAs_Pt();
+        this->tag = GAMETAG::BULLET;
+    }
+
+    // COLLISION LAYER is which layer can be hurt by this type of bullet
+    Bullet(float _damageAmt, sf::Vector2f velocity, sf::Vector2f pos, int count, Grid* g, const std::vector<WORLD_GROUP>& _canDamage, EntityHandle _owner = EntityHandle()) : Bullet()
+    {
+        Reset(_damageAmt, velocity, pos, count, g, _canDamage, _owner);
+    }
+
+    // Sets the bullet up to be fired. Used for new bullets and ones coming back out of the BulletManager pool
+    void Reset(float _damageAmt, sf::Vector2f velocity, sf::Vector2f pos, int count, Grid* g, const std::vector<WORLD_GROUP>& _canDamage, EntityHandle _owner)
+    {
+        this->bulletDamageAmount = _damageAmt;
+        this->canDamage = _canDamage; // Reuses the old storage when recycled
+        this->owner = _owner;
+        this->grid = g;
+        this->alive = true;
+        id = count;
+        setPosition(pos);
+        v = velocity;
+    }
+
+    std::string debugInfo() override
+    {
+        return "Bullet" + std::to_string(id);
+    }
+
+    int Update(float dt)
+    {
+        sf::Vector2f from = getPosition();
+        sf::Vector2f to = from + v * dt;
+
+        // COLLISION STUFF
+        // Checks the whole path since the last tick, not just where the bullet ends up, so it can't skip over
+        // anything however fast it goes or however long a tick is
+        Sweep(from, to, damageQueue->bulletHitPolicy == BULLET_HIT_POLICY::ALL, sweepHits);
+        if (sweepHits.size() > 0)
+        {
+            // Only record the hits, they get applied after every collision has been checked
+            for (EntityHandle g : sweepHits)
+            {
+                damageQueue->Push(g, owner, bulletDamageAmount, DAMAGE_KIND::BULLET);
+            }
+            return -1;
+        }
+
+        setPosition(to);
+        // If it leaves the room
+        if (!grid->isInBounds(to))
+        {
+            return -1; // Signal to BulletManager to delete this
+        }
+        return 0;
+    }
+
+    // Everything this bullet can hurt that the segment from -> to touches. all = false: only the earliest hit.
+    // all = true: everything, in handle order. Ties go to the lower handle, so the result is the same whichever
+    // broadphase backend found the candidates
+    void Sweep(sf::Vector2f from, sf::Vector2f to, bool all, std::vector<EntityHandle>& out)
+    {
+        out.clear();
+        unsigned groupMask = 0;
+        for (WORLD_GROUP w_group : canDamage) groupMask |= GroupBit(w_group);
+        sweepCandidates.clear();
+        broadphase->QuerySegment(from, to, groupMask, sweepCandidates);
+
+        float earliest = 2; // Further than any hit
+        EntityHandle first;
+        for (EntityHandle h : sweepCandidates)
+        {
+            GameObject* g = entities.Resolve(h);
+            float t;
+            if (g == nullptr || !g->segmentCollides(from, to, t)) continue;
+            if (all) out.push_back(h);
+            else if (t < earliest || (t == earliest && h.value < first.value))
+            {
+                earliest = t;
+                first = h;
+            }
+        }
+
+        if (all) std::sort(out.begin(), out.end(), [](EntityHandle a, EntityHandle b) { return a.value < b.value; });
+        else if (!first.isNull()) out.push_back(first);
+    }
+
+
+
+
+    void Draw() override
+    {
+        spriteBatch.Add(sprite, getPosition(), sf::Vector2f({ 5,5 }), sf::Vector2f(), getTint(sf::Color::Magenta));
+    }
+};
+
+// Who fired a bullet, which decides what it can hurt. Also indexes BULLET_TYPES and BulletManager's lists
+enum class BULLET_TYPE {PLAYER=0, ENEMY=1, COUNT};
+
+struct BulletTypeInfo
+{
+    float damage;
+    float speed; // Pixels per second
+    WORLD_GROUP canDamage;
+};
+
+constexpr BulletTypeInfo BULLET_TYPES[] = {
+    { 10, 600, WORLD_GROUP::ENEMY }, // PLAYER
+    { 10, 600, WORLD_GROUP::PLAYER }, // ENEMY
+};
+static_assert((int)std::size(BULLET_TYPES) == static_cast<int>(BULLET_TYPE::COUNT), "Every bullet type needs an entry in BULLET_TYPES");
+
+// Everything needed to recreate a bullet on an earlier tick
+struct BulletState
+{
+    BULLET_TYPE bulletType;
+    sf::Vector2f position;
+    sf::Vector2f velocity;
+    float damage;
+    EntityHandle owner;
+};
+
+// One instance of this in game
+class BulletManager
+{
+    private: 
+        static const int BULLET_TYPE_COUNT = static_cast<int>(BULLET_TYPE::COUNT);
+        std::vector<Bullet*> bullets[BULLET_TYPE_COUNT]; // Live bullets of each type
+        std::vector<Bullet*> freeBullets; // Dead bullets waiting to be reused
+        std::vector<ConeQuery> homingQueries; // Reused every tick
+        std::vector<TargetHit> homingHits;
+
+        // Which groups a bullet type can hurt, as Bullet wants it
+        static const std::vector<WORLD_GROUP>& targetsFor(BULLET_TYPE bulletType)
+        {
+            static const std::array<std::vector<WORLD_GROUP>, BULLET_TYPE_COUNT> targets = []()
+                {
+                    std::array<std::vector<WORLD_GROUP>, BULLET_TYPE_COUNT> t;
+                    for (int i = 0; i < BULLET_TYPE_COUNT; i++) t[i] = { BULLET_TYPES[i].canDamage };
+                    return t;
+                }();
+            return targets[static_cast<int>(bulletType)];
+        }
+
+        // Takes a bullet out of the pool, or makes one if it is empty
+        Bullet* take()
+        {
+            if (freeBullets.empty()) return new Bullet();
+            Bullet* b = freeBullets.back();
+            freeBullets.pop_back();
+            b->handle = entities.Create(b);
+            return b;
+        }
+
+        // Takes a bullet out of the pool and fires it
+        Bullet* spawn(BULLET_TYPE bulletType, float damage, sf::Vector2f velocity, sf::Vector2f pos, EntityHandle owner)
+        {
+            Bullet* b = take();
+            b->Reset(damage, velocity, pos, getBulletCount(bulletType), grid, targetsFor(bulletType), owner);
+            if (!quiet) std::cout << "Bullet[" << b->id << "]" << " with velocity " << velocity.x << "," << velocity.y << "\n";
+            addBullet(bulletType, b);
+            return b;
+        }
+
+        // Puts a dead bullet back in the pool. Its handle goes stale, so anything still pointing at it finds out
+        void recycle(Bullet* b)
+        {
+            b->alive = false;
+            entities.Destroy(b->handle);
+            freeBullets.push_back(b);
+        }
+
+    public:
+        Grid* grid;
+        EntityHandle player;
+        SpriteHandle bulletSprite; // Requested once here so spawning a bullet never touches the asset cache
+        DamageQueue* damageQueue;
+        bool quiet = false; // No console output, for headless worlds
+
+        Broadphase* broadphase = nullptr; // What bullets collide against, the world updates it every tick
+
+        // Homing player bullets and auto-aim. Both look targets up in this, which the world updates every tick
+        const TargetBVH* targets = nullptr;
+        bool homing = false;
+        const float HOMING_RANGE = 400;
+        const float HOMING_CONE_COS = 0.5f; // 60 degrees either side of where the bullet is going
+        const float HOMING_TURN_RATE = 5; // Radians per second
+        const float AUTO_AIM_RANGE = 500;
+        const float AUTO_AIM_CONE_COS = 0.94f; // About 20 degrees
+
+        // Turns dir towards the nearest enemy close to that direction, if homing is on
+        sf::Vector2f AutoAim(sf::Vector2f from, sf::Vector2f dir)
+        {
+            if (!homing || targets == nullptr) return dir;
+            TargetHit hit = targets->NearestInCone(ConeQuery{ from, dir }, AUTO_AIM_CONE_COS, AUTO_AIM_RANGE);
+            if (hit.handle.isNull() || hit.distanceSq == 0) return dir;
+            return (hit.position - from).normalized();
+        }
+
+
+        // Fires a bullet with its type's damage and speed. dir should be normalized
+        void createBullet(BULLET_TYPE bulletType, sf::Vector2f pos, sf::Vector2f dir, EntityHandle owner)
+        {
+            const BulletTypeInfo& info = BULLET_TYPES[static_cast<int>(bulletType)];
+            spawn(bulletType, info.damage, dir * info.speed, pos, owner);
+        }
+
+        // Only the ones overlapping view
+        void DrawBullets(const AABB& view)
+        {
+            for (std::vector<Bullet*>& collection : bullets)
+            {
+                for (auto& b : collection)
+                {
+                    if (!b->getAABB().overlaps(view)) continue;
+                    b->Draw();
+                    if (b->flashFrames > 0) b->flashFrames--;
+                }
+            }
+        }
+
+        int getBulletCount(BULLET_TYPE type)
+        {
+            return bullets[static_cast<int>(type)].size();
+        }
+
+        void addBullet(BULLET_TYPE type, Bullet* b)
+        {
+            b->sprite = bulletSprite;
+            b->damageQueue = damageQueue;
+            b->broadphase = broadphase;
+            bullets[static_cast<int>(type)].push_back(b);
+        }
+
+        void UpdateBullets(std::vector<Bullet*>& collection, float dt)
+        {
+            for (auto it = collection.begin(); it != collection.end(); /* no increment here */) {
+                int result = (*it)->Update(dt); // Update now returns int
+                if (result == -1) { // Delete bullets that return -1 (delete flag)
+                    recycle(*it);
+
+                    it = collection.erase(it); // erase returns the next valid iterator
+                }
+                else {
+                    ++it; // only increment if not erased
+                }
+            }
+        }
+
+        // Turns player bullets towards the nearest enemy ahead of them, a little each tick. Speed stays the same.
+        // Every bullet's target is found in one batch
+        void SteerHoming(float dt)
+        {
+            std::vector<Bullet*>& playerBullets = bullets[static_cast<int>(BULLET_TYPE::PLAYER)];
+            homingQueries.clear();
+            for (Bullet* b : playerBullets)
+            {
+                float speed = b->v.length();
+                homingQueries.push_back(ConeQuery{ b->getPosition(), speed > 0 ? b->v / speed : sf::Vector2f() });
+            }
+            targets->NearestInCone(homingQueries, HOMING_CONE_COS, HOMING_RANGE, homingHits);
+
+            float maxTurn = HOMING_TURN_RATE * dt;
+            for (int i = 0; i < (int)playerBullets.size(); i++)
+            {
+                if (homingHits[i].handle.isNull()) continue;
+                Bullet* b = playerBullets[i];
+                sf::Vector2f want = homingHits[i].position - b->getPosition();
+                float turn = std::clamp(std::atan2(b->v.x * want.y - b->v.y * want.x, b->v.x * want.x + b->v.y * want.y), -maxTurn, maxTurn);
+                float c = std::cos(turn);
+                float s = std::sin(turn);
+                b->v = sf::Vector2f{ b->v.x * c - b->v.y * s, b->v.x * s + b->v.y * c };
+            }
+        }
+
+        int Update(float dt)
+        {
+            if (homing && targets != nullptr) SteerHoming(dt);
+            for (std::vector<Bullet*>& collection : bullets) UpdateBullets(collection, dt);
+            // Check for collisions
+
+            return 0;
+        }
+
+        // Removes every bullet (they go back in the pool)
+        void Clear()
+        {
+            for (std::vector<Bullet*>& collection : bullets)
+            {
+                for (Bullet* b : collection)
+                {
+                    recycle(b);
+                }
+                collection.clear();
+            }
+        }
+
+        void SaveState(std::vector<BulletState>& out)
+        {
+            out.clear();
+            for (int type = 0; type < BULLET_TYPE_COUNT; type++)
+            {
+                for (Bullet* b : bullets[type]) out.push_back(BulletState{ static_cast<BULLET_TYPE>(type), b->getPosition(), b->v, b->bulletDamageAmount, b->owner });
+            }
+        }
+
+        // Makes the live bullets match states. Bullets that are still around are reset where they are and keep
+        // their handles, so a rollback only goes to the pool for the difference
+        void LoadState(const std::vector<BulletState>& states)
+        {
+            int used[BULLET_TYPE_COUNT] = {};
+            for (const BulletState& state : states)
+            {
+                int type = static_cast<int>(state.bulletType);
+                std::vector<Bullet*>& collection = bullets[type];
+                int index = used[type]++;
+                if (index < (int)collection.size())
+                {
+                    collection[index]->Reset(state.damage, state.velocity, state.position, index, grid, targetsFor(state.bulletType), state.owner);
+                    continue;
+                }
+                Bullet* b = take();
+                b->Reset(state.damage, state.velocity, state.position, index, grid, targetsFor(state.bulletType), state.owner);
+                addBullet(state.bulletType, b);
+            }
+            // Whatever is left over wasn't there yet on that tick
+            for (int type = 0; type < BULLET_TYPE_COUNT; type++)
+            {
+                std::vector<Bullet*>& collection = bullets[type];
+                for (int i = used[type]; i < (int)collection.size(); i++) recycle(collection[i]);
+                collection.resize(used[type]);
+            }
+        }
+
+        ~BulletManager()
+        {
+            for (std::vector<Bullet*>& collection : bullets)
+            {
+                for (Bullet* b : collection) delete b;
+            }
+            for (Bullet* b : freeBullets) delete b;
+        }
+
+        // cache can be null, then bullets keep the placeholder sprite
+        void Init(Grid* g, GameObject* p, DamageQueue* d, AssetCache* cache)
+        {
+            this->grid = g;
+            this->player = p->handle;
+            this->damageQueue = d;
+            if (cache != nullptr) this->bulletSprite = cache->Request("bullet");
+        }
+};
+
+// Everything needed to put a player back to how it was on an earlier tick
+struct PlayerState
+{
+    sf::Vector2f position;
+    sf::Vector2f lastDir;
+    float health;
+    int deaths;
+};
+
+class Player : public GridGameObject
+{
+private:
+    sf::Vector2f lastDir = sf::Vector2f(0, -1);
+
+public:
+    float r_Size = 48; // pixels
+    sf::Angle gunRot;
+    const float movSpd = 300.0f;
+    const float strafeSpd = 300.0f;
+    BulletManager* bulletManager;
+    PlayerInput input; // Set before every Update
+    sf::Color color = sf::Color::Red;
+    bool quiet = false; // No console output, for headless worlds
+    int deaths = 0;
+    //std::vector<Bullet*> bullets;
+
+    PlayerState SaveState()
+    {
+        return PlayerState{ getPosition(), lastDir, health, deaths };
+    }
+
+    void LoadState(const PlayerState& state)
+    {
+        lastDir = state.lastDir;
+        health = state.health;
+        deaths = state.deaths;
+        setPosition(state.position);
+    }
+
+    std::string debugInfo() override
+    {
+        return "Player";
+    }
+
+    // cache can be null, then the player keeps the placeholder sprite
+    void Init(Grid* g, BulletManager* b, AssetCache* cache)
+    {
+        this->group = WORLD_GROUP::PLAYER;
+        this->setCollisionAs_Box(r_Size, r_Size, COLLISIONBOXORIGIN::CENTER);
+        this->bulletManager = b;
+        this->tag = GAMETAG::PLAYER;
+        if (cache != nullptr) this->sprite = cache->Request("player");
+        this->maxHealth = 100;
+        this->health = maxHealth;
+        GridGameObject::Init(g);
+        
+        setPosition(sf::Vector2f({ g->MAPWIDTH / 2.0f, g->MAPHEIGHT / 2.0f }));
+        gunRot = sf::degrees(360);
+        if (!quiet) std::cout << "Bulletmanager is null? " << (bulletManager == nullptr) << "\n";
+    }
+
+    // Only reads this->input (never the keyboard) so replaying a tick gives the same result
+    int Update(float dt) override
+    {
+        // Normalize it
+        sf::Vector2f move = sf::Vector2f(input.x, input.y);
+        if (move.length() > 0)
+        {
+            move = move.normalized();
+            float _spd = 0;
+
+            // Not Strafing
+            if (input.strafe) _spd = strafeSpd;
+            else { _spd = movSpd, lastDir = move; }
+            //std::cout << "Input: " << move.x << ", " << move.y << "\n";
+            sf::Vector2f newPos = getPosition() + (move * (_spd * dt));
+            // Stay inside the room
+            newPos.x = std::clamp(newPos.x, 0.0f, (float)grid->MAPWIDTH);
+            newPos.y = std::clamp(newPos.y, 0.0f, (float)grid->MAPHEIGHT);
+            setPosition(newPos);
+        }
+
+        if (input.fire) OnFireButtonPress();
+
+        // Run update on any bullets
+        
+        
+        return 0;
+    }
+    
+    // Respawn in the middle of the room
+    void OnDeath() override
+    {
+        if (!quiet) std::cout << debugInfo() << " died\n";
+        deaths++;
+        health = maxHealth;
+        setPosition(sf::Vector2f({ grid->MAPWIDTH / 2.0f, grid->MAPHEIGHT / 2.0f }));
+    }
+
+    void OnFireButtonPress()
+    {
+        // spawn bullet
+        //Bullet* b = new Bullet(lastDir, , bulletManager->getBulletCount(0), grid, std::vector<COLLISION_LAYER>{COLLISION_LAYER::ENEMY}, this);
+        bulletManager->createBullet(BULLET_TYPE::PLAYER, getPosition(), bulletManager->AutoAim(getPosition(), lastDir), handle);
+        //bulletManager->addBullet(0, b); 
+    }
+
+    /*
+    void DrawBullets()
+    {
+        for (auto& b : bullets)
+        {
+            b->Draw();
+        }
+    }*/
+
+    void Draw() override
+    {
+        // Draw player
+        spriteBatch.Add(sprite, getPosition(), sf::Vector2f({ r_Size, r_Size }), sf::Vector2f({ r_Size / 2, r_Size / 2 }), getTint(color));
+
+        // Draw gun
+        spriteBatch.Add(SpriteHandle(), getPosition(), sf::Vector2f({ 10, 48 }), sf::Vector2f({ 5,0 }), sf::Color::Black,
+            sf::radians(-3.14159265f / 2 + std::atan2(lastDir.y, lastDir.x)));
+
+
+
+    }
+};
+// A list of types, only used at compile time
+template <typename... Ts>
+struct TypeList {};
+
+// A setting that a .rooms file can set on a spawn by writing name=value, e.g. Enemy(x=100, y=200, amplitude=50);
+template <typename T, typename M>
+struct Param
+{
+    const char* name;
+    M T::* member;
+};
+
+template <typename T, typename M>
+constexpr Param<T, M> MakeParam(const char* name, M T::* member) { return Param<T, M>{ name, member }; }
+
+// Turns the text from a .rooms file into a setting's type. Returns false if it doesn't parse
+inline bool ParseParam(const std::string& text, float& out)
+{
+    char* end;
+    float value = std::strtof(text.c_str(), &end);
+    if (end == text.c_str()) return false;
+    out = value;
+    return true;
+}
+
+inline bool ParseParam(const std::string& text, int& out)
+{
+    char* end;
+    long value = std::strtol(text.c_str(), &end, 10);
+    if (end == text.c_str()) return false;
+    out = (int)value;
+    return true;
+}
+
+inline bool ParseParam(const std::string& text, std::string& out)
+{
+    out = text;
+    return true;
+}
+
+// Sets every one of T::Params() that properties has a value for. Anything else in properties is left alone
+template <typename T>
+void BindParams(T& object, const std::map<std::string, std::string>& properties)
+{
+    std::apply([&](const auto&... params)
+        {
+            auto bind = [&](const auto& param)
+                {
+                    auto found = properties.find(param.name);
+                    if (found == properties.end()) return;
+                    if (!ParseParam(found->second, object.*(param.member)))
+                    {
+                        std::cout << "[ROOMS]: can't read " << param.name << "=" << found->second << " on " << T::TypeName << ", keeping " << object.*(param.member) << "\n";
+                    }
+                };
+            (bind(params), ...);
+        }, T::Params());
+}
+
+// Keeps the memory of dead objects of one type so the next one of that type doesn't have to allocate.
+// Objects are properly destroyed when they go in and constructed again when they come out, so a reused one
+// is the same as a new one (and gets a new handle)
+template <typename T>
+class EntityPool
+{
+public:
+    EntityPool() {}
+    EntityPool(const EntityPool&) = delete;
+    EntityPool& operator=(const EntityPool&) = delete;
+
+    ~EntityPool()
+    {
+        for (T* p : free) ::operator delete(static_cast<void*>(p));
+    }
+
+    T* Pop()
+    {
+        if (free.empty()) return new T();
+        T* p = free.back();
+        free.pop_back();
+        return new (p) T();
+    }
+
+    void Push(T* object)
+    {
+        object->~T();
+        free.push_back(object);
+    }
+
+private:
+    std::vector<T*> free; // Destroyed, only the memory is left
+};
+
+// Everything that can be spawned by name from a .rooms file, as a compile time table over the types in List.
+// Every type derives from Base, has a unique static constexpr TypeName and a static Params() (it can inherit
+// Params() from its base). Name lookup is a perfect hash found by the compiler, so spawning is a hash, one
+// compare to reject names that aren't registered, and a call through a table of per-type functions.
+// New types only need adding to the list
+template <typename Base, typename List>
+class EntityRegistry;
+
+template <typename Base, typename... Ts>
+class EntityRegistry<Base, TypeList<Ts...>>
+{
+public:
+    static constexpr int COUNT = sizeof...(Ts);
+    static constexpr std::string_view names[COUNT] = { Ts::TypeName... };
+
+    // One pool per type, for whoever is spawning (pools aren't thread safe, so each world has its own)
+    using Pools = std::tuple<EntityPool<Ts>...>;
+
+    // Type id for a name, -1 if nothing is registered under it
+    static int Find(std::string_view name)
+    {
+        int id = table[Hash(name, SEED) & MASK];
+        return id >= 0 && names[id] == name ? id : -1;
+    }
+
+    template <typename T>
+    static constexpr int IdOf()
+    {
+        constexpr bool matches[COUNT] = { std::is_same_v<T, Ts>... };
+        for (int i = 0; i < COUNT; i++) if (matches[i]) return i;
+        return -1;
+    }
+
+    // A new object of type id out of its pool, with properties bound if there are any. Not Init'd yet
+    static Base* Spawn(int id, Pools& pools, const std::map<std::string, std::string>* properties)
+    {
+        return spawners[id](pools, properties);
+    }
+
+    // Binds properties again on something that was already spawned
+    static void Bind(int id, Base* object, const std::map<std::string, std::string>& properties)
+    {
+        binders[id](object, properties);
+    }
+
+    // Hands a spawned object of type id back to its pool
+    static void Release(int id, Pools& pools, Base* object)
+    {
+        releasers[id](pools, object);
+    }
+
+private:
+    static constexpr std::uint32_t Hash(std::string_view text, std::uint32_t seed)
+    {
+        std::uint32_t h = 2166136261u ^ seed; // FNV-1a
+        for (char c : text) h = (h ^ (std::uint8_t)c) * 16777619u;
+        return h ^ (h >> 15);
+    }
+
+    static constexpr int TableSize()
+    {
+        int size = 1;
+        while (size < COUNT * 2) size *= 2;
+        return size;
+    }
+    static constexpr std::uint32_t MASK = TableSize() - 1;
+
+    // First seed where every name lands in its own slot
+    static constexpr std::uint32_t FindSeed()
+    {
+        for (std::uint32_t seed = 0; seed < 100000; seed++)
+        {
+            bool used[TableSize()] = {};
+            bool ok = true;
+            for (int i = 0; i < COUNT && ok; i++)
+            {
+                std::uint32_t slot = Hash(names[i], seed) & MASK;
+                ok = !used[slot];
+                used[slot] = true;
+            }
+            if (ok) return seed;
+        }
+        return ~0u;
+    }
+    static constexpr std::uint32_t SEED = FindSeed();
+    static_assert(SEED != ~0u, "No perfect hash for the registered names, is one of them used twice?");
+
+    static constexpr std::array<int, TableSize()> MakeTable()
+    {
+        std::array<int, TableSize()> t{};
+        for (int& slot : t) slot = -1;
+        for (int i = 0; i < COUNT; i++) t[Hash(names[i], SEED) & MASK] = i;
+        return t;
+    }
+    static constexpr std::array<int, TableSize()> table = MakeTable();
+
+    template <typename T>
+    static Base* SpawnAs(Pools& pools, const std::map<std::string, std::string>* properties)
+    {
+        T* object = std::get<EntityPool<T>>(pools).Pop();
+        object->typeId = IdOf<T>();
+        if (properties != nullptr) BindParams(*object, *properties);
+        return object;
+    }
+
+    template <typename T>
+    static void BindAs(Base* object, const std::map<std::string, std::string>& properties)
+    {
+        BindParams(*static_cast<T*>(object), properties);
+    }
+
+    template <typename T>
+    static void ReleaseAs(Pools& pools, Base* object)
+    {
+        std::get<EntityPool<T>>(pools).Push(static_cast<T*>(object));
+    }
+
+    using SpawnFn = Base* (*)(Pools&, const std::map<std::string, std::string>*);
+    using BindFn = void (*)(Base*, const std::map<std::string, std::string>&);
+    using ReleaseFn = void (*)(Pools&, Base*);
+    static constexpr SpawnFn spawners[COUNT] = { &SpawnAs<Ts>... };
+    static constexpr BindFn binders[COUNT] = { &BindAs<Ts>... };
+    static constexpr ReleaseFn releasers[COUNT] = { &ReleaseAs<Ts>... };
+};
+
+// Everything needed to put something a room spawned back to how it was on an earlier tick. Whatever else a
+// type needs to keep goes in vars, in an order of its own choosing
+struct SpawnState
+{
+    sf::Vector2f position;
+    float health;
+    bool alive;
+    BehaviourProgress behaviour;
+    std::array<float, 4> vars;
+};
+
+// What a spawned object gets to see of the world it was spawned into
+struct SpawnContext
+{
+    Grid* grid;
+    Player* player; // Who enemies shoot at and who picks things up
+    BulletManager* bulletManager;
+    int* score;
+    AssetCache* cache; // Null in headless worlds, sprites then stay the placeholder
+};
+
+// Base of everything SpawnRegistry can spawn. The EnemyManager only deals with this, so a new type doesn't
+// need anything from the types already there
+class Spawnable : public GridGameObject
+{
+public:
+    std::string spriteName; // assets/<spriteName>.png
+    BehaviourProgress behaviour; // Only used by types with a behaviour, see MakeBehaviour
+
+    // Registry type id, set when spawned. Which spawn in the .rooms file this came from, so hot reloads can find
+    // it again. spawnOrdinal is -1 if it wasn't loaded from a file
+    int typeId = -1;
+    int spawnOrdinal = -1;
+    sf::Vector2f spawnPosition;
+
+    virtual void Init(const SpawnContext& context, sf::Vector2f startPos) = 0;
+
+    virtual SpawnState SaveState()
+    {
+        return SpawnState{ getPosition(), health, alive, behaviour, {} };
+    }
+
+    virtual void LoadState(const SpawnState& state)
+    {
+        health = state.health;
+        behaviour = state.behaviour;
+        if (state.alive)
+        {
+            // Might be coming back from the dead after a rollback
+            alive = true;
+            setPosition(state.position);
+        }
+        else
+        {
+            if (alive) Despawn();
+            GameObject::setPosition(state.position);
+        }
+    }
+
+    // Dead ones stay in the EnemyManager list (so snapshots still line up) but drop out of the broadphase
+    void OnDeath() override
+    {
+        Despawn();
+    }
+
+    // Types driven by a coroutine return it here. The manager starts it from wherever behaviour says it is up to.
+    // The rest use Update
+    virtual std::optional<Behaviour> MakeBehaviour() { return std::nullopt; }
+
+    // Moves the spawn point without resetting anything else
+    virtual void MoveSpawn(sf::Vector2f pos)
+    {
+        spawnPosition = pos;
+        if (alive) setPosition(pos);
+        else GameObject::setPosition(pos); // Don't put dead ones back in the grid
+    }
+};
+
+class Enemy : public Spawnable
+{
+public:
+    static constexpr const char* TypeName = "Enemy";
+
+    // What a .rooms file can set on a spawn
+    static constexpr auto Params()
+    {
+        return std::make_tuple(
+            MakeParam("amplitude", &Enemy::amplitude),
+            MakeParam("timeScale", &Enemy::timeScale),
+            MakeParam("fireWaitTime", &Enemy::fireWaitTime),
+            MakeParam("distanceToFire", &Enemy::distanceToFire),
+            MakeParam("sprite", &Enemy::spriteName));
+    }
+
+    float r_Size = 64;
+    GAMETAG tag = GAMETAG::ENEMY;
+    float y_center;
+    EntityHandle player; // Who to shoot at
+    BulletManager* bulletManager;
+
+
+    float y;
+    float _timer;
+    float fireTimer; // counter
+
+
+    // Settings
+    float amplitude = 200;
+    float timeScale = 1;
+    float fireWaitTime = 0.1f; // Seconds
+    float distanceToFire = 85;
+
+    Enemy()
+    {
+        this->group = WORLD_GROUP::ENEMY;
+        this->spriteName = "enemy";
+    }
+
+    void Init(const SpawnContext& context, sf::Vector2f startPos) override
+    {
+        if (context.cache != nullptr) this->sprite = context.cache->Request(spriteName);
+        this->maxHealth = 50;
+        this->health = maxHealth;
+        this->setCollisionAs_Box(r_Size, r_Size, COLLISIONBOXORIGIN::CENTER);
+        bulletManager = context.bulletManager;
+        player = context.player->handle;
+        GridGameObject::Init(context.grid);
+        setPosition(startPos);
+        spawnPosition = startPos;
+        y_center = getPosition().y;
+        y = y_center;
+        _timer = 0;
+        fireTimer = fireWaitTime; // Allowed to fire immediately
+    }
+
+    std::string debugInfo() { return "Enemy"; }
+
+    SpawnState SaveState() override
+    {
+        SpawnState state = Spawnable::SaveState();
+        state.vars = { y_center, y, _timer, fireTimer };
+        return state;
+    }
+
+    void LoadState(const SpawnState& state) override
+    {
+        y_center = state.vars[0];
+        y = state.vars[1];
+        _timer = state.vars[2];
+        fireTimer = state.vars[3];
+        Spawnable::LoadState(state);
+    }
+
+    // Moves the point this enemy moves around without resetting its timers
+    void MoveSpawn(sf::Vector2f pos) override
+    {
+        y_center = pos.y;
+        Spawnable::MoveSpawn(pos);
+    }
+
+
+    void Draw() override
+    {
+        spriteBatch.Add(sprite, getPosition(), sf::Vector2f({ r_Size, r_Size }), sf::Vector2f({ r_Size / 2, r_Size / 2 }), getTint(sf::Color::Yellow));
+
+    }
+
+    int Update(float dt) override
+    {
+        //std::cout << "In enemy update\n";
+        y = y_center + amplitude*std::sin(_timer*timeScale);
+        this->setPosition(sf::Vector2f{ getPosition().x, y });
+        
+        Player* target = entities.Resolve<Player>(player);
+        if (target != nullptr && std::abs(y - target->getPosition().y) <= distanceToFire && fireTimer >= fireWaitTime)
+        {
+            Fire();
+        }
+        else fireTimer += dt;
+        
+
+        _timer += dt;
+        return 0;
+
+    }
+
+    virtual void Fire()
+    {
+        Player* target = entities.Resolve<Player>(player);
+        if (target == nullptr) return;
+        fireTimer = 0;
+        //std::cout << "Enemy fire bullet!";
+        sf::Vector2f direction = target->getPosition() - getPosition();
+        
+        //if (player->getPosition().x <= getPosition().x) _dir.x = -1;
+        //else _dir.x = 1;
+
+        
+        bulletManager->createBullet(BULLET_TYPE::ENEMY, getPosition(), direction.normalized(), handle);
+        //EnemyBulletManager.SpawnBullet
+    }
+
+    bool collidesWithPt(sf::Vector2f pt)
+    {
+        sf::RectangleShape r = sf::RectangleShape(sf::Vector2f({ r_Size, r_Size }));
+        //r.setFillColor(sf::Color::Yellow);
+        //r.setOutlineThickness(2.0f);
+        r.setOrigin(sf::Vector2f({ r_Size / 2, r_Size / 2 }));
+        r.setPosition(getPosition());
+        return r.getGlobalBounds().contains(pt);
+    }
+};
+
+class Enemy360Shot : public Enemy
+{
+    public:
+        static constexpr const char* TypeName = "Enemy360Shot";
+
+        Enemy360Shot()
+        {
+            this->distanceToFire = 300;
+            this->spriteName = "enemy360";
+        }
+
+        int Update(float dt) override
+        {
+            //std::cout << "In enemy update\n";
+            //y = y_center + amplitude * std::sin(_timer * timeScale);
+            //this->setPosition(sf::Vector2f{ getPosition().x, y });
+            Player* target = entities.Resolve<Player>(player);
+            float dist = target != nullptr ? (getPosition() - target->getPosition()).length() : distanceToFire + 1;
+            if (dist <= distanceToFire && fireTimer >= fireWaitTime)
+            {
+                Fire();
+            }
+            else fireTimer += dt;
+            //std::cout << "Distance to player " << dist << "\n";
+
+            _timer += dt;
+            return 0;
+        }
+
+        void Fire() override
+        {
+            Player* target = entities.Resolve<Player>(player);
+            if (target == nullptr) return;
+            fireTimer = 0;
+            //std::cout << "Enemy fire bullet!";
+            sf::Vector2f direction = target->getPosition() - getPosition();
+
+            //if (player->getPosition().x <= getPosition().x) _dir.x = -1;
+            //else _dir.x = 1;
+
+
+            bulletManager->createBullet(BULLET_TYPE::ENEMY, getPosition(), direction.normalized(), handle);
+            //EnemyBulletManager.SpawnBullet
+        }
+
+        void Draw() override
+        {
+            spriteBatch.Add(sprite, getPosition(), sf::Vector2f({ r_Size, r_Size }), sf::Vector2f({ r_Size / 2, r_Size / 2 }), getTint(sf::Color::Green));
+
+        }
+};
+
+// One entity placement inside a room block, e.g. Enemy(x=100, y=200);
+struct RoomSpawn
+{
+    std::string type;
+    sf::Vector2f position;
+    std::map<std::string, std::string> properties; // Everything that was written as key=value
+};
+
+// A single room of the level. Rooms can be bigger than the screen, the camera scrolls around them
+struct Room
+{
+    std::string name = "startBlock";
+    std::string bg = "grass"; // Background texture, assets/<bg>.png
+    std::string description;
+    float width = 1600;
+    float height = 1200;
+    std::map<std::string, std::string> neighbors; // left/right/up/down -> room name
+    std::vector<RoomSpawn> spawns;
+    SpriteHandle background;
+
+    sf::Vector2f getSize() { return sf::Vector2f{ width, height }; }
+};
+
+// Everything in a .rooms file (STARTFILE ... ENDFILE)
+struct RoomFile
+{
+    std::string name;
+    std::string description;
+    float roomWidth = SCREEN_WIDTH;
+    float roomHeight = SCREEN_HEIGHT;
+    int gridSize = 32;
+    std::vector<Room> rooms;
+
+    // Returns nullptr if there is no room with that name
+    Room* findRoom(const std::string& roomName)
+    {
+        for (Room& r : rooms)
+        {
+            if (r.name == roomName) return &r;
+        }
+        return nullptr;
+    }
+};
+
+// Reads the .rooms format (see level1.rooms). Throws std::runtime_error if the file is malformed
+class RoomParser
+{
+public:
+    static RoomFile ParseFile(const std::string& path)
+    {
+        std::ifstream in(path);
+        if (!in) throw std::runtime_error("Could not open rooms file: " + path);
+        std::stringstream ss;
+        ss << in.rdbuf();
+        return Parse(ss.str());
+    }
+
+    static RoomFile Parse(const std::string& text)
+    {
+        RoomFile file;
+        Room* block = nullptr;
+        bool inFile = false;
+        std::stringstream lines(text);
+        std::string line;
+        int lineNumber = 0;
+
+        while (std::getline(lines, line))
+        {
+            lineNumber++;
+            line = clean(line);
+            if (line.empty()) continue;
+
+            if (line == "STARTFILE") { inFile = true; continue; }
+            if (line == "ENDFILE") break;
+            if (!inFile) throw std::runtime_error("Line " + std::to_string(lineNumber) + ": expected STARTFILE");
+
+            if (line == "STARTBLOCK")
+            {
+                file.rooms.push_back(Room());
+                block = &file.rooms.back();
+                block->width = file.roomWidth;
+                block->height = file.roomHeight;
+                continue;
+            }
+            if (line == "ENDBLOCK") { block = nullptr; continue; }
+
+            size_t paren = line.find('(');
+            size_t equals = line.find('=');
+            if (paren != std::string::npos && (equals == std::string::npos || paren < equals))
+            {
+                if (block == nullptr) throw std::runtime_error("Line " + std::to_string(lineNumber) + ": spawn outside of a block");
+                block->spawns.push_back(parseSpawn(line, lineNumber));
+            }
+            else if (equals != std::string::npos)
+            {
+                std::string key = trim(line.substr(0, equals));
+                std::string value = unquote(trim(line.substr(equals + 1)));
+                if (block == nullptr) setFileProperty(file, key, value);
+                else setRoomProperty(*block, key, value);
+            }
+            else throw std::runtime_error("Line " + std::to_string(lineNumber) + ": could not parse '" + line + "'");
+        }
+        return file;
+    }
+
+private:
+    static std::string trim(const std::string& s)
+    {
+        size_t start = s.find_first_not_of(" \t\r\n");
+        if (start == std::string::npos) return "";
+        size_t end = s.find_last_not_of(" \t\r\n");
+        return s.substr(start, end - start + 1);
+    }
+
+    // Strips comments, whitespace and the trailing ;
+    static std::string clean(std::string line)
+    {
+        size_t comment = line.find("//");
+        if (comment != std::string::npos) line = line.substr(0, comment);
+        line = trim(line);
+        if (!line.empty() && line.back() == ';') line.pop_back();
+        return trim(line);
+    }
+
+    static std::string unquote(const std::string& s)
+    {
+        if (s.size() >= 2 && s.front() == '"' && s.back() == '"') return s.substr(1, s.size() - 2);
+        return s;
+    }
+
+    static float toFloat(const std::string& s, int lineNumber)
+    {
+        try { return std::stof(s); }
+        catch (const std::exception&) { throw std::runtime_error("Line " + std::to_string(lineNumber) + ": expected a number, got '" + s + "'"); }
+    }
+
+    // Type(x=1, y=2, other=3). Arguments without a key are x then y
+    static RoomSpawn parseSpawn(const std::string& line, int lineNumber)
+    {
+        size_t open = line.find('(');
+        size_t close = line.rfind(')');
+        if (close == std::string::npos || close < open) throw std::runtime_error("Line " + std::to_string(lineNumber) + ": missing ')'");
+
+        RoomSpawn spawn;
+        spawn.type = trim(line.substr(0, open));
+        std::stringstream args(line.substr(open + 1, close - open - 1));
+        std::string arg;
+        int positional = 0;
+        while (std::getline(args, arg, ','))
+        {
+            arg = trim(arg);
+            if (arg.empty()) continue;
+            size_t equals = arg.find('=');
+            std::string key, value;
+            if (equals == std::string::npos)
+            {
+                if (positional > 1) throw std::runtime_error("Line " + std::to_string(lineNumber) + ": too many unnamed arguments");
+                key = positional == 0 ? "x" : "y";
+                value = arg;
+                positional++;
+            }
+            else
+            {
+                key = trim(arg.substr(0, equals));
+                value = unquote(trim(arg.substr(equals + 1)));
+                if (key == "x") positional = std::max(positional, 1);
+                else if (key == "y") positional = 2;
+            }
+            spawn.properties[key] = value;
+            if (key == "x") spawn.position.x = toFloat(value, lineNumber);
+            else if (key == "y") spawn.position.y = toFloat(value, lineNumber);
+        }
+        return spawn;
+    }
+
+    static void setFileProperty(RoomFile& file, const std::string& key, const std::string& value)
+    {
+        if (key == "name") file.name = value;
+        else if (key == "description") file.description = value;
+        else if (key == "roomwidth") file.roomWidth = std::stof(value);
+        else if (key == "roomheight") file.roomHeight = std::stof(value);
+        else if (key == "gridSize") file.gridSize = std::stoi(value);
+        else std::cout << "[ROOMS]: unknown file property " << key << "\n";
+    }
+
+    static void setRoomProperty(Room& room, const std::string& key, const std::string& value)
+    {
+        if (key == "name") room.name = value;
+        else if (key == "bg") room.bg = value;
+        else if (key == "description") room.description = value;
+        // Rooms can override the size from the file header
+        else if (key == "roomwidth") room.width = std::stof(value);
+        else if (key == "roomheight") room.height = std::stof(value);
+        else if (key == "left" || key == "right" || key == "up" || key == "down") room.neighbors[key] = value;
+        else std::cout << "[ROOMS]: unknown room property " << key << "\n";
+    }
+};
+
+// Watches a .rooms file on a background thread and re-parses it whenever it changes, so the
+// game loop only ever has to pick up a finished RoomFile. Uses inotify on Linux, polls the
+// modification time everywhere else
+class RoomFileWatcher
+{
+public:
+    ~RoomFileWatcher()
+    {
+        Stop();
+    }
+
+    void Start(const std::string& filePath)
+    {
+        path = filePath;
+        running = true;
+        worker = std::thread([this]()
+            {
+                AllocScope scope(ALLOC_SCOPE::BACKGROUND);
+                Run();
+            });
+    }
+
+    void Stop()
+    {
+        running = false;
+        if (worker.joinable()) worker.join();
+    }
+
+    // Hands over the newest parsed file if there is one. Never waits on the worker
+    bool TakeUpdate(RoomFile& out)
+    {
+        if (!hasUpdate) return false;
+        std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+        if (!lock.owns_lock()) return false; // Worker is publishing right now, get it next frame
+        out = std::move(latest);
+        hasUpdate = false;
+        return true;
+    }
+
+private:
+    std::string path;
+    std::thread worker;
+    std::atomic<bool> running = false;
+    std::atomic<bool> hasUpdate = false;
+    std::mutex mutex;
+    RoomFile latest;
+
+    void Reload()
+    {
+        try
+        {
+            RoomFile parsed = RoomParser::ParseFile(path);
+            std::lock_guard<std::mutex> lock(mutex);
+            latest = std::move(parsed);
+            hasUpdate = true;
+            std::cout << "[ROOMS]: reloaded " << path << "\n";
+        }
+        catch (const std::exception& e)
+        {
+            // Keep playing the old version until the file is fixed
+            std::cout << "[ROOMS]: reload failed: " << e.what() << "\n";
+        }
+    }
+
+#ifdef __linux__
+    void Run()
+    {
+        int fd = inotify_init1(IN_NONBLOCK);
+        if (fd < 0) { std::cout << "[ROOMS]: inotify unavailable, hot reload disabled\n"; return; }
+        // Watch the directory, editors often save by writing a new file and renaming it over the old one
+        std::filesystem::path file = std::filesystem::absolute(path);
+        int wd = inotify_add_watch(fd, file.parent_path().c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+        std::string fileName = file.filename().string();
+
+        alignas(inotify_event) char buffer[4096];
+        while (running)
+        {
+            pollfd p = { fd, POLLIN, 0 };
+            if (poll(&p, 1, 200) <= 0) continue; // Timeout so Stop() is noticed
+
+            bool changed = false;
+            ssize_t len;
+            while ((len = read(fd, buffer, sizeof(buffer))) > 0)
+            {
+                for (char* ptr = buffer; ptr < buffer + len; ptr += sizeof(inotify_event) + ((inotify_event*)ptr)->len)
+                {
+                    inotify_event* ev = (inotify_event*)ptr;
+                    if (ev->len > 0 && fileName == ev->name) changed = true;
+                }
+            }
+            if (changed) Reload();
+        }
+        inotify_rm_watch(fd, wd);
+        close(fd);
+    }
+#else
+    void Run()
+    {
+        std::error_code ec;
+        auto lastWrite = std::filesystem::last_write_time(path, ec);
+        while (running)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            auto now = std::filesystem::last_write_time(path, ec);
+            if (!ec && now != lastWrite)
+            {
+                lastWrite = now;
+                Reload();
+            }
+        }
+    }
+#endif
+};
+
+// Driven by a coroutine: sways left and right for 2s, fires a burst of 5, waits half a second, repeat. The script
+// sleeps through the whole sway in one wait, Update only works out the sway from the time spent in it.
+// behaviour.step is 0 before the sway, 1 during it and then counts the shots, so the script can be started
+// again part way through after a rollback
+class EnemyBurst : public Enemy
+{
+    public:
+        static constexpr const char* TypeName = "EnemyBurst";
+        int burstSize = 5;
+
+        static constexpr auto Params()
+        {
+            return std::tuple_cat(Enemy::Params(), std::make_tuple(MakeParam("burstSize", &EnemyBurst::burstSize)));
+        }
+
+        EnemyBurst()
+        {
+            this->amplitude = 120;
+            this->timeScale = 3;
+            this->spriteName = "enemyburst";
+        }
+
+        int Update(float dt) override
+        {
+            if (behaviour.step != 1) return 0;
+            _timer += dt;
+            setPosition(sf::Vector2f{ spawnPosition.x + amplitude * std::sin(_timer * timeScale), y_center });
+            return 0;
+        }
+
+        std::optional<Behaviour> MakeBehaviour() override
+        {
+            return Pattern();
+        }
+
+        Behaviour Pattern()
+        {
+            while (true)
+            {
+                if (behaviour.step == 0)
+                {
+                    behaviour.step = 1;
+                    co_await Wait(2.0f);
+                }
+                while (behaviour.step <= burstSize)
+                {
+                    Fire();
+                    behaviour.step++;
+                    co_await Wait(0.08f);
+                }
+                behaviour.step = 0;
+                co_await Wait(0.5f);
+            }
+        }
+
+        void Draw() override
+        {
+            spriteBatch.Add(sprite, getPosition(), sf::Vector2f({ r_Size, r_Size }), sf::Vector2f({ r_Size / 2, r_Size / 2 }), getTint(sf::Color::Cyan));
+        }
+};
+
+// Worth value points to whoever walks over it first. Lives in the EnemyManager with everything else a room
+// spawns (so rollback snapshots and hot reloads cover it), but isn't in the enemy group, so bullets and homing
+// ignore it. Only the first player picks coins up
+class Coin : public Spawnable
+{
+    public:
+        static constexpr const char* TypeName = "Coin";
+        int value = 50;
+        float r_Size = 24;
+        EntityHandle player; // Who can pick it up
+        int* score = nullptr;
+
+        static constexpr auto Params()
+        {
+            return std::make_tuple(MakeParam("value", &Coin::value), MakeParam("sprite", &Coin::spriteName));
+        }
+
+        Coin()
+        {
+            this->group = WORLD_GROUP::OTHER;
+            this->spriteName = "coin";
+        }
+
+        void Init(const SpawnContext& context, sf::Vector2f startPos) override
+        {
+            if (context.cache != nullptr) this->sprite = context.cache->Request(spriteName);
+            this->maxHealth = 1;
+            this->health = maxHealth;
+            this->setCollisionAs_Box(r_Size, r_Size, COLLISIONBOXORIGIN::CENTER);
+            player = context.player->handle;
+            score = context.score;
+            GridGameObject::Init(context.grid);
+            setPosition(startPos);
+            spawnPosition = startPos;
+        }
+
+        std::string debugInfo() override { return "Coin"; }
+
+        int Update(float) override
+        {
+            Player* target = entities.Resolve<Player>(player);
+            if (target == nullptr || !isCollidingWith(target)) return 0;
+            *score += value;
+            Despawn();
+            return 0;
+        }
+
+        void Draw() override
+        {
+            spriteBatch.Add(sprite, getPosition(), sf::Vector2f({ r_Size, r_Size }), sf::Vector2f({ r_Size / 2, r_Size / 2 }), getTint(sf::Color(255, 215, 0)));
+        }
+};
+
+// Everything a .rooms file can spawn
+using SpawnRegistry = EntityRegistry<Spawnable, TypeList<Enemy, Enemy360Shot, EnemyBurst, Coin>>;
+
+// Position of a room in an endless generated level. y grows downwards, like on screen
+struct RoomCoord
+{
+    int x = 0;
+    int y = 0;
+
+    bool operator==(const RoomCoord& other) const { return x == other.x && y == other.y; }
+    RoomCoord operator+(const RoomCoord& other) const { return RoomCoord{ x + other.x, y + other.y }; }
+};
+
+struct RoomCoordHash
+{
+    size_t operator()(const RoomCoord& c) const
+    {
+        return std::hash<std::uint64_t>()(((std::uint64_t)(std::uint32_t)c.x << 32) | (std::uint32_t)c.y);
+    }
+};
+
+// Which way a left/right/up/down neighbor link goes. (0, 0) for anything else
+RoomCoord NeighborOffset(const std::string& side)
+{
+    if (side == "left") return RoomCoord{ -1, 0 };
+    if (side == "right") return RoomCoord{ 1, 0 };
+    if (side == "up") return RoomCoord{ 0, -1 };
+    if (side == "down") return RoomCoord{ 0, 1 };
+    return RoomCoord{ 0, 0 };
+}
+
+// Makes rooms for an endless level, in the same form RoomParser gives. A room only depends on the seed and
+// its coordinate, never on which rooms were made before it, so a seed always gives the same level however
+// it is explored. Has its own integer RNG so the result doesn't depend on the standard library's distributions
+class RoomGenerator
+{
+public:
+    std::uint64_t seed = 0;
+    float roomWidth = SCREEN_WIDTH;
+    float roomHeight = SCREEN_HEIGHT;
+    int tileSize = 32; // Spawns are placed on a grid of these
+
+    Room Generate(RoomCoord c) const
+    {
+        Rng rng{ Mix(c, 0) };
+        Room room;
+        room.name = Name(c);
+        room.bg = rng.Below(2) == 0 ? "grass" : "sand";
+        room.width = roomWidth * (1 + rng.Below(2));
+        room.height = roomHeight * (1 + rng.Below(2));
+
+        // Left and right always lead somewhere, so each row is one long corridor. Up and down are decided per
+        // edge rather than per room, so both sides of a door agree it is there
+        room.neighbors["left"] = Name(c + RoomCoord{ -1, 0 });
+        room.neighbors["right"] = Name(c + RoomCoord{ 1, 0 });
+        if (HasVerticalDoor(c)) room.neighbors["up"] = Name(c + RoomCoord{ 0, -1 });
+        if (HasVerticalDoor(c + RoomCoord{ 0, 1 })) room.neighbors["down"] = Name(c + RoomCoord{ 0, 1 });
+
+        // Gets harder further from the start. The start room is kept easy
+        bool start = c == RoomCoord{ 0, 0 };
+        int distance = std::abs(c.x) + std::abs(c.y);
+        int enemies = start ? 1 : std::min(2 + distance / 2, 8) + rng.Below(2);
+        int coins = rng.Below(5);
+
+        // Nothing spawns within MARGIN tiles of an edge (where the player walks in) or on top of something else
+        const int MARGIN = 3;
+        int cols = (int)(room.width / tileSize);
+        int rows = (int)(room.height / tileSize);
+        if (cols <= 2 * MARGIN || rows <= 2 * MARGIN) return room; // Too small to put anything in
+        std::vector<bool> taken(cols * rows, false);
+        if (start)
+        {
+            // Player starts in the middle
+            for (int y = rows / 2 - 2; y <= rows / 2 + 2; y++)
+                for (int x = cols / 2 - 2; x <= cols / 2 + 2; x++) taken[y * cols + x] = true;
+        }
+        auto place = [&](const std::string& type)
+            {
+                // Gives up quietly if the room is too crowded
+                for (int attempt = 0; attempt < 16; attempt++)
+                {
+                    int x = MARGIN + rng.Below(std::max(1, cols - 2 * MARGIN));
+                    int y = MARGIN + rng.Below(std::max(1, rows - 2 * MARGIN));
+                    if (taken[y * cols + x]) continue;
+                    taken[y * cols + x] = true;
+
+                    RoomSpawn spawn;
+                    spawn.type = type;
+                    spawn.position = sf::Vector2f{ (x + 0.5f) * tileSize, (y + 0.5f) * tileSize };
+                    spawn.properties["x"] = std::to_string((int)spawn.position.x);
+                    spawn.properties["y"] = std::to_string((int)spawn.position.y);
+                    room.spawns.push_back(spawn);
+                    return;
+                }
+            };
+        for (int i = 0; i < enemies; i++)
+        {
+            int roll = rng.Below(10);
+            place(roll < 5 ? "Enemy" : roll < 8 ? "Enemy360Shot" : "EnemyBurst");
+        }
+        for (int i = 0; i < coins; i++) place("Coin");
+        return room;
+    }
+
+    static std::string Name(RoomCoord c)
+    {
+        return "gen_" + std::to_string(c.x) + "_" + std::to_string(c.y);
+    }
+
+private:
+    // splitmix64
+    struct Rng
+    {
+        std::uint64_t state;
+
+        std::uint64_t Next()
+        {
+            std::uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            return z ^ (z >> 31);
+        }
+
+        // 0 to n - 1
+        int Below(int n) { return (int)(Next() % (std::uint64_t)n); }
+    };
+
+    std::uint64_t Mix(RoomCoord c, std::uint64_t salt) const
+    {
+        Rng r{ seed ^ (((std::uint64_t)(std::uint32_t)c.x << 32) | (std::uint32_t)c.y) };
+        r.state ^= r.Next() + salt;
+        return r.Next();
+    }
+
+    // The door between c and the room above it
+    bool HasVerticalDoor(RoomCoord c) const
+    {
+        Rng r{ Mix(c, 1) };
+        return r.Below(2) == 0;
+    }
+};
+
+// Keeps the generated rooms around the player in memory. A worker generates ahead of the player and drops
+// rooms that are far behind, so the level can go on forever. The main thread never waits on it
+class RoomStreamer
+{
+public:
+    RoomGenerator generator;
+    int keepRadius = 2; // Rooms up to this many steps away (in x or y) get generated
+
+    ~RoomStreamer()
+    {
+        Stop();
+    }
+
+    void Start(RoomCoord focus)
+    {
+        Focus(focus);
+        running = true;
+        worker = std::thread([this]()
+            {
+                AllocScope scope(ALLOC_SCOPE::BACKGROUND);
+                Run();
+            });
+    }
+
+    void Stop()
+    {
+        running = false;
+        wake.notify_all();
+        if (worker.joinable()) worker.join();
+    }
+
+    // Generate around c from now on
+    void Focus(RoomCoord c)
+    {
+        focusX = c.x;
+        focusY = c.y;
+        focusVersion++;
+        wake.notify_all();
+    }
+
+    // Copies out the room at c. False if it isn't generated yet, or the worker is storing one right now
+    bool TryGet(RoomCoord c, Room& out)
+    {
+        std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+        if (!lock.owns_lock()) return false;
+        auto found = rooms.find(c);
+        if (found == rooms.end()) return false;
+        out = found->second;
+        return true;
+    }
+
+private:
+    std::unordered_map<RoomCoord, Room, RoomCoordHash> rooms; // Sparse, only what's near the player
+    std::mutex mutex; // Guards rooms
+    std::mutex wakeMutex;
+    std::condition_variable wake;
+    std::atomic<int> focusX = 0;
+    std::atomic<int> focusY = 0;
+    std::atomic<int> focusVersion = 0;
+    std::atomic<bool> running = false;
+    std::thread worker;
+
+    static int StepsBetween(RoomCoord a, RoomCoord b)
+    {
+        return std::max(std::abs(a.x - b.x), std::abs(a.y - b.y));
+    }
+
+    void Run()
+    {
+        int done = -1; // focusVersion that has been fully generated
+        std::vector<RoomCoord> wanted;
+        while (running)
+        {
+            int version = focusVersion;
+            if (version == done)
+            {
+                std::unique_lock<std::mutex> lock(wakeMutex);
+                wake.wait_for(lock, std::chrono::milliseconds(200), [&]() { return !running || focusVersion != done; });
+                continue;
+            }
+
+            RoomCoord focus{ focusX, focusY };
+            // Nearest first, so the rooms next to the player are ready soonest
+            wanted.clear();
+            for (int dy = -keepRadius; dy <= keepRadius; dy++)
+                for (int dx = -keepRadius; dx <= keepRadius; dx++) wanted.push_back(focus + RoomCoord{ dx, dy });
+            std::sort(wanted.begin(), wanted.end(), [&](RoomCoord a, RoomCoord b) { return StepsBetween(a, focus) < StepsBetween(b, focus); });
+
+            bool interrupted = false;
+            for (RoomCoord c : wanted)
+            {
+                // The player moved on, start again around the new spot
+                if (!running || focusVersion != version) { interrupted = true; break; }
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (rooms.count(c) != 0) continue;
+                }
+                Room room = generator.Generate(c); // Outside the lock, the main thread can keep reading
+                std::lock_guard<std::mutex> lock(mutex);
+                rooms.emplace(c, std::move(room));
+            }
+            if (interrupted) continue;
+
+            // One step of slack, so walking back and forth over a border doesn't regenerate anything
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                std::erase_if(rooms, [&](const auto& entry) { return StepsBetween(entry.first, focus) > keepRadius + 1; });
+            }
+            done = version;
+        }
+    }
+};
+
+class EnemyManager
+{
+    private:
+        SpawnContext context;
+        BehaviourScheduler* behaviours;
+        SpawnRegistry::Pools pools;
+
+    public:
+        std::vector<Spawnable*> enemyList; // Everything spawned, including pickups
+
+        EnemyManager(const SpawnContext& c, BehaviourScheduler* s)
+        {
+            context = c;
+            behaviours = s;
+        }
+
+        // Stop the behaviours first, they point at the enemies
+        ~EnemyManager()
+        {
+            for (Spawnable* e : enemyList) delete e;
+        }
+
+        // typeId comes from SpawnRegistry. properties (can be null) are bound before Init
+        Spawnable* createEnemy(sf::Vector2f location, int typeId, const std::map<std::string, std::string>* properties = nullptr)
+        {
+            Spawnable* e = SpawnRegistry::Spawn(typeId, pools, properties);
+            e->Init(context, location);
+            startBehaviour(e);
+            enemyList.push_back(e);
+            return e;
+        }
+
+        template <typename T = Enemy>
+        T* createEnemy(sf::Vector2f location)
+        {
+            return static_cast<T*>(createEnemy(location, SpawnRegistry::IdOf<T>()));
+        }
+
+        void startBehaviour(Spawnable* e)
+        {
+            if (std::optional<Behaviour> b = e->MakeBehaviour()) behaviours->Start(*b, e->handle, e->behaviour);
+        }
+
+        void removeEnemy(int index)
+        {
+            Spawnable* e = enemyList[index];
+            enemyList.erase(enemyList.begin() + index);
+            SpawnRegistry::Release(e->typeId, pools, e);
+        }
+
+        // Makes the live enemies match a room's spawn list. Enemies still in the list keep their state and only
+        // move if their spawn point moved, new spawns are created and removed ones deleted.
+        // Spawns are matched by type and by their order among spawns of the same type. Settings from the file
+        // are bound again on the ones that were kept
+        void ApplyRoomSpawns(const std::vector<RoomSpawn>& spawns)
+        {
+            int ordinals[SpawnRegistry::COUNT] = {};
+            std::vector<bool> matched(enemyList.size(), false);
+            for (const RoomSpawn& spawn : spawns)
+            {
+                int type = SpawnRegistry::Find(spawn.type);
+                if (type < 0)
+                {
+                    std::cout << "[ROOMS]: no entity type " << spawn.type << ", skipping\n";
+                    continue;
+                }
+                int ordinal = ordinals[type]++;
+
+                int found = -1;
+                for (int i = 0; i < (int)enemyList.size(); i++)
+                {
+                    if (!matched[i] && enemyList[i]->spawnOrdinal == ordinal && enemyList[i]->typeId == type) { found = i; break; }
+                }
+
+                if (found >= 0)
+                {
+                    matched[found] = true;
+                    Spawnable* e = enemyList[found];
+                    SpawnRegistry::Bind(type, e, spawn.properties);
+                    if (context.cache != nullptr) e->sprite = context.cache->Request(e->spriteName);
+                    if (e->spawnPosition != spawn.position) e->MoveSpawn(spawn.position);
+                }
+                else
+                {
+                    Spawnable* e = createEnemy(spawn.position, type, &spawn.properties);
+                    e->spawnOrdinal = ordinal;
+                    matched.push_back(true);
+                }
+            }
+
+            // Whatever came from the file but wasn't matched has been deleted from it
+            for (int i = (int)enemyList.size() - 1; i >= 0; i--)
+            {
+                if (!matched[i] && enemyList[i]->spawnOrdinal >= 0) removeEnemy(i);
+            }
+        }
+
+        // Deletes every enemy
+        void Clear()
+        {
+            for (int i = (int)enemyList.size() - 1; i >= 0; i--) removeEnemy(i);
+        }
+
+        // Writes one state per enemy, in enemyList order
+        void SaveState(std::vector<SpawnState>& out)
+        {
+            out.clear();
+            for (Spawnable* e : enemyList)
+            {
+                out.push_back(e->SaveState());
+            }
+        }
+
+        // Also restarts every behaviour from the restored progress. The old coroutines are thrown away,
+        // they were part way through a future that didn't happen
+        void LoadState(const std::vector<SpawnState>& states, int tick)
+        {
+            if (states.size() != enemyList.size()) throw std::runtime_error("Enemy snapshot does not match the enemy list");
+            behaviours->Clear();
+            behaviours->currentTick = tick;
+            for (int i = 0; i < (int)enemyList.size(); i++)
+            {
+                Spawnable* e = enemyList[i];
+                e->LoadState(states[i]);
+                if (e->alive && e->behaviour.wakeTick >= 0) startBehaviour(e);
+            }
+        }
+
+        void Update(float dt)
+        {
+            for (Spawnable* e : enemyList)
+            {
+                if (e->alive) e->Update(dt);
+            }
+            //debugPrint();
+        }
+
+        void Draw()
+        {
+            for (Spawnable* e : enemyList)
+            {
+                e->Draw();
+            }
+        }
+
+        void debugPrint()
+        {
+            std::cout << "enemyList: ";
+            for (int i = 0; i < enemyList.size(); i++)
+            {
+                std::cout << enemyList[i]->debugInfo() << ",";
+            }
+            std::cout << "\n";
+        }
+};
+
+
+
+// Randomized correctness checks and microbenchmarks for the collision primitives.
+// Run with --collision-selftest; prints one JSON object per line and exits non-zero on any mismatch.
+class CollisionSelfTest
+{
+    public:
+        static int Run(unsigned int seed)
+        {
+            std::mt19937 rng(seed);
+            int failures = 0;
+            failures += CheckPairs(rng, 200000);
+            failures += CheckBatches(rng);
+            failures += CheckTargetBVH(rng);
+            failures += CheckSweeps(rng);
+            BenchPrimitives(rng);
+            BenchBatches(rng);
+            BenchTargetBVH(rng);
+            BenchSweeps(rng);
+            BenchBroadphase(rng);
+            std::cout << "{\"summary\":\"collision\",\"seed\":" << seed << ",\"failures\":" << failures << "}\n";
+            return failures;
+        }
+
+    private:
+        class TestObject : public GameObject
+        {
+            public:
+                std::string debugInfo() override { return "TestObject"; }
+        };
+
+        // Written independently of GameObject so a bug in one doesn't hide in the other
+        struct RefShape
+        {
+            COLLISIONTYPE type;
+            float x, y;
+            float w, h; // Box
+            float r; // Circle
+            bool centered;
+
+            AABB box() const
+            {
+                if (centered) return AABB{ x - w / 2, x + w / 2, y - h / 2, y + h / 2 };
+                return AABB{ x, x + w, y, y + h };
+            }
+        };
+
+        static bool refPtBox(const RefShape& p, const RefShape& b)
+        {
+            AABB bb = b.box();
+            return !(p.x < bb.minX || p.x > bb.maxX || p.y < bb.minY || p.y > bb.maxY);
+        }
+        static bool refPtCircle(const RefShape& p, const RefShape& c)
+        {
+            float dx = p.x - c.x, dy = p.y - c.y;
+            return dx * dx + dy * dy <= c.r * c.r;
+        }
+        static bool refBoxBox(const RefShape& a, const RefShape& b)
+        {
+            // Touching edges don't count
+            AABB ba = a.box(), bb = b.box();
+            return !(ba.maxX <= bb.minX || bb.maxX <= ba.minX || ba.maxY <= bb.minY || bb.maxY <= ba.minY);
+        }
+        static bool refBoxCircle(const RefShape& b, const RefShape& c)
+        {
+            AABB bb = b.box();
+            float dx = std::max({ bb.minX - c.x, 0.0f, c.x - bb.maxX });
+            float dy = std::max({ bb.minY - c.y, 0.0f, c.y - bb.maxY });
+            return dx * dx + dy * dy <= c.r * c.r;
+        }
+        static bool refCircleCircle(const RefShape& a, const RefShape& b)
+        {
+            float dx = a.x - b.x, dy = a.y - b.y, r = a.r + b.r;
+            return dx * dx + dy * dy <= r * r;
+        }
+        static bool refColliding(const RefShape& a, const RefShape& b)
+        {
+            using C = COLLISIONTYPE;
+            if (a.type == C::POINT && b.type == C::BOX) return refPtBox(a, b);
+            if (a.type == C::BOX && b.type == C::POINT) return refPtBox(b, a);
+            if (a.type == C::POINT && b.type == C::CIRCLE) return refPtCircle(a, b);
+            if (a.type == C::CIRCLE && b.type == C::POINT) return refPtCircle(b, a);
+            if (a.type == C::BOX && b.type == C::BOX) return refBoxBox(a, b);
+            if (a.type == C::BOX && b.type == C::CIRCLE) return refBoxCircle(a, b);
+            if (a.type == C::CIRCLE && b.type == C::BOX) return refBoxCircle(b, a);
+            return refCircleCircle(a, b);
+        }
+
+        // Coordinates snap to quarter units so touching edges and zero sizes come up often
+        // and every bound is exactly representable
+        static RefShape RandomShape(std::mt19937& rng, COLLISIONTYPE type)
+        {
+            std::uniform_int_distribution<int> coord(-256, 256);
+            std::uniform_int_distribution<int> size(0, 64);
+            std::uniform_int_distribution<int> coin(0, 1);
+            RefShape s{ type, coord(rng) * 0.25f, coord(rng) * 0.25f, size(rng) * 0.5f, size(rng) * 0.5f, size(rng) * 0.5f, coin(rng) == 1 };
+            return s;
+        }
+        static COLLISIONTYPE RandomType(std::mt19937& rng, bool allowPoint)
+        {
+            std::uniform_int_distribution<int> pick(allowPoint ? 0 : 1, 2);
+            int t = pick(rng);
+            return t == 0 ? COLLISIONTYPE::POINT : t == 1 ? COLLISIONTYPE::BOX : COLLISIONTYPE::CIRCLE;
+        }
+        static void Apply(TestObject& o, const RefShape& s)
+        {
+            if (s.type == COLLISIONTYPE::BOX) o.setCollisionAs_Box(s.w, s.h, s.centered ? COLLISIONBOXORIGIN::CENTER : COLLISIONBOXORIGIN::TOPLEFT);
+            else if (s.type == COLLISIONTYPE::CIRCLE) o.setCollisionAs_Circle(s.r);
+            else o.setCollisionAs_Pt();
+            o.setPosition(sf::Vector2f{ s.x, s.y });
+        }
+        static const char* TypeName(COLLISIONTYPE t)
+        {
+            return t == COLLISIONTYPE::POINT ? "point" : t == COLLISIONTYPE::BOX ? "box" : "circle";
+        }
+
+        // isCollidingWith must agree with the reference and be symmetric for every shape pairing
+        static int CheckPairs(std::mt19937& rng, int cases)
+        {
+            TestObject a, b;
+            int failures = 0;
+            int printed = 0;
+            for (int i = 0; i < cases; i++)
+            {
+                COLLISIONTYPE ta = RandomType(rng, true);
+                COLLISIONTYPE tb = RandomType(rng, ta != COLLISIONTYPE::POINT);
+                RefShape ra = RandomShape(rng, ta), rb = RandomShape(rng, tb);
+                Apply(a, ra);
+                Apply(b, rb);
+
+                bool expected = refColliding(ra, rb);
+                bool ab = a.isCollidingWith(&b);
+                bool ba = b.isCollidingWith(&a);
+                if (ab != expected || ba != expected)
+                {
+                    failures++;
+                    if (printed++ < 10)
+                    {
+                        std::cout << "{\"test\":\"isCollidingWith\",\"a\":\"" << TypeName(ta) << "\",\"b\":\"" << TypeName(tb)
+                            << "\",\"ax\":" << ra.x << ",\"ay\":" << ra.y << ",\"aw\":" << ra.w << ",\"ah\":" << ra.h << ",\"ar\":" << ra.r << ",\"acentered\":" << ra.centered
+                            << ",\"bx\":" << rb.x << ",\"by\":" << rb.y << ",\"bw\":" << rb.w << ",\"bh\":" << rb.h << ",\"br\":" << rb.r << ",\"bcentered\":" << rb.centered
+                            << ",\"expected\":" << expected << ",\"ab\":" << ab << ",\"ba\":" << ba << "}\n";
+                    }
+                }
+            }
+
+            // Point to point is documented as unsupported
+            a.setCollisionAs_Pt();
+            b.setCollisionAs_Pt();
+            bool threw = false;
+            try { a.isCollidingWith(&b); }
+            catch (const std::runtime_error&) { threw = true; }
+            if (!threw) failures++;
+
+            std::cout << "{\"test\":\"isCollidingWith\",\"cases\":" << cases << ",\"failures\":" << failures << "}\n";
+            return failures;
+        }
+
+        // GetCollisionsAll/CheckForCollisionsAny must match a brute-force pass over the reference
+        static int CheckBatches(std::mt19937& rng)
+        {
+            int failures = 0;
+            const int sizes[] = { 0, 1, 16, 256 };
+            for (int n : sizes)
+            {
+                for (int round = 0; round < 50; round++)
+                {
+                    std::vector<std::unique_ptr<TestObject>> objs;
+                    std::vector<RefShape> shapes;
+                    std::vector<EntityHandle> handles;
+                    for (int i = 0; i < n; i++)
+                    {
+                        objs.push_back(std::make_unique<TestObject>());
+                        shapes.push_back(RandomShape(rng, RandomType(rng, false)));
+                        Apply(*objs.back(), shapes.back());
+                        handles.push_back(objs.back()->handle);
+                    }
+                    // A stale handle in the list must be skipped
+                    {
+                        TestObject gone;
+                        handles.push_back(gone.handle);
+                    }
+
+                    TestObject query;
+                    RefShape rq = RandomShape(rng, RandomType(rng, true));
+                    Apply(query, rq);
+
+                    std::vector<EntityHandle> expected;
+                    for (int i = 0; i < n; i++) if (refColliding(rq, shapes[i])) expected.push_back(handles[i]);
+                    std::vector<EntityHandle> got;
+                    query.GetCollisionsAll(handles, got);
+
+                    bool ok = got.size() == expected.size();
+                    for (int i = 0; ok && i < (int)got.size(); i++) ok = got[i] == expected[i];
+                    ok = ok && query.CheckForCollisionsAny(handles) == !expected.empty();
+                    if (!ok) failures++;
+                }
+            }
+            std::cout << "{\"test\":\"GetCollisionsAll\",\"cases\":" << 50 * 4 << ",\"failures\":" << failures << "}\n";
+            return failures;
+        }
+
+        // TargetBVH queries must give exactly what a brute-force pass gives, also after refits and deaths
+        static int CheckTargetBVH(std::mt19937& rng)
+        {
+            std::uniform_real_distribution<float> coord(0, 2000);
+            std::uniform_real_distribution<float> unit(-1, 1);
+            std::uniform_int_distribution<int> count(0, 300);
+            int failures = 0;
+            int cases = 0;
+            for (int round = 0; round < 40; round++)
+            {
+                std::vector<std::unique_ptr<TestObject>> owned;
+                std::vector<TestObject*> objs;
+                int n = count(rng);
+                for (int i = 0; i < n; i++)
+                {
+                    owned.push_back(std::make_unique<TestObject>());
+                    objs.push_back(owned.back().get());
+                    Apply(*objs.back(), RefShape{ i % 2 ? COLLISIONTYPE::BOX : COLLISIONTYPE::CIRCLE, coord(rng), coord(rng), 48, 48, 24, true });
+                }
+
+                TargetBVH bvh;
+                bvh.targetGroup = WORLD_GROUP::OTHER;
+                for (int step = 0; step < 4; step++)
+                {
+                    bvh.Update(objs);
+                    std::vector<sf::Vector2f> batchFrom;
+                    for (int q = 0; q < 100; q++)
+                    {
+                        cases++;
+                        ConeQuery query{ sf::Vector2f{ coord(rng), coord(rng) }, sf::Vector2f{ unit(rng), unit(rng) } };
+                        batchFrom.push_back(query.from);
+                        if (query.dir.length() == 0) continue;
+                        query.dir = query.dir.normalized();
+                        float cosHalf = unit(rng);
+                        float range = coord(rng);
+                        int k = 1 + (int)(std::abs(unit(rng)) * (TargetBVH::MAX_K - 1));
+
+                        // Brute force over everything alive, ties to the lower handle
+                        TargetHit best;
+                        best.distanceSq = range * range;
+                        std::vector<TargetHit> all;
+                        for (TestObject* o : objs)
+                        {
+                            if (!o->alive) continue;
+                            const AABB& b = o->getAABB();
+                            sf::Vector2f c{ (b.minX + b.maxX) / 2, (b.minY + b.maxY) / 2 };
+                            sf::Vector2f d = c - query.from;
+                            float dd = d.x * d.x + d.y * d.y;
+                            if (dd <= range * range) all.push_back(TargetHit{ o->handle, c, dd });
+                            bool closer = dd < best.distanceSq || (dd == best.distanceSq && (best.handle.isNull() || o->handle.value < best.handle.value));
+                            if (closer && d.x * query.dir.x + d.y * query.dir.y >= cosHalf * std::sqrt(dd)) best = TargetHit{ o->handle, c, dd };
+                        }
+                        std::sort(all.begin(), all.end(), [](const TargetHit& a, const TargetHit& b)
+                            {
+                                return a.distanceSq != b.distanceSq ? a.distanceSq < b.distanceSq : a.handle.value < b.handle.value;
+                            });
+
+                        bool ok = bvh.NearestInCone(query, cosHalf, range).handle == best.handle;
+                        TargetHit hits[TargetBVH::MAX_K];
+                        int found = bvh.KNearest(query.from, k, range, hits);
+                        ok = ok && found == std::min(k, (int)all.size());
+                        for (int i = 0; ok && i < found; i++) ok = hits[i].handle == all[i].handle;
+                        if (!ok) failures++;
+                    }
+
+                    // The batched k-nearest has to give what one query at a time gives
+                    std::vector<TargetHit> batchHits;
+                    std::vector<int> batchCounts;
+                    bvh.KNearest(batchFrom, 4, 500, batchHits, batchCounts);
+                    for (int q = 0; q < (int)batchFrom.size(); q++)
+                    {
+                        cases++;
+                        TargetHit hits[4];
+                        int found = bvh.KNearest(batchFrom[q], 4, 500, hits);
+                        bool ok = found == batchCounts[q];
+                        for (int i = 0; ok && i < found; i++) ok = hits[i].handle == batchHits[q * 4 + i].handle;
+                        if (!ok) failures++;
+                    }
+
+                    // Move everything (refit), sometimes kill some (rebuild)
+                    for (TestObject* o : objs)
+                    {
+                        o->setPosition(o->getPosition() + sf::Vector2f{ unit(rng) * 20, unit(rng) * 20 });
+                        if (step == 2 && unit(rng) > 0.8f) o->alive = false;
+                    }
+                }
+            }
+            std::cout << "{\"test\":\"TargetBVH\",\"cases\":" << cases << ",\"failures\":" << failures << "}\n";
+            return failures;
+        }
+
+        // Homing-sized batches: one cone query per bullet against a room full of enemies
+        static void BenchTargetBVH(std::mt19937& rng)
+        {
+            std::uniform_real_distribution<float> coord(0, 2000);
+            std::uniform_real_distribution<float> unit(-1, 1);
+            const int sizes[] = { 16, 256, 1024 };
+            const int QUERIES = 20000;
+            for (int n : sizes)
+            {
+                std::vector<std::unique_ptr<TestObject>> owned;
+                std::vector<TestObject*> objs;
+                for (int i = 0; i < n; i++)
+                {
+                    owned.push_back(std::make_unique<TestObject>());
+                    objs.push_back(owned.back().get());
+                    Apply(*objs.back(), RefShape{ COLLISIONTYPE::BOX, coord(rng), coord(rng), 48, 48, 0, true });
+                }
+                std::vector<ConeQuery> queries;
+                for (int i = 0; i < QUERIES; i++)
+                {
+                    sf::Vector2f dir{ unit(rng), unit(rng) };
+                    queries.push_back(ConeQuery{ sf::Vector2f{ coord(rng), coord(rng) }, dir.length() > 0 ? dir.normalized() : sf::Vector2f{ 1, 0 } });
+                }
+
+                TargetBVH bvh;
+                bvh.targetGroup = WORLD_GROUP::OTHER;
+                std::vector<TargetHit> hits;
+                std::string suffix = "/" + std::to_string(n);
+                Time(("TargetBVH.Update" + suffix).c_str(), 200, [&](int ops)
+                    {
+                        for (int i = 0; i < ops; i++)
+                        {
+                            objs[i % n]->setPosition(objs[i % n]->getPosition() + sf::Vector2f{ 1, 0 });
+                            bvh.Update(objs);
+                        }
+                        return bvh.size() > 0 ? ops : 0;
+                    });
+                Time(("TargetBVH.NearestInCone" + suffix).c_str(), QUERIES * 10, [&](int ops)
+                    {
+                        int found = 0;
+                        for (int i = 0; i < ops / QUERIES; i++)
+                        {
+                            bvh.NearestInCone(queries, 0.5f, 400, hits);
+                            for (const TargetHit& h : hits) found += h.handle.isNull() ? 0 : 1;
+                        }
+                        return found;
+                    });
+                std::vector<sf::Vector2f> froms;
+                for (const ConeQuery& q : queries) froms.push_back(q.from);
+                std::vector<int> counts;
+                Time(("TargetBVH.KNearest4" + suffix).c_str(), QUERIES * 10, [&](int ops)
+                    {
+                        int found = 0;
+                        for (int i = 0; i < ops / QUERIES; i++)
+                        {
+                            bvh.KNearest(froms, 4, 400, hits, counts);
+                            for (int c : counts) found += c > 0 ? 1 : 0;
+                        }
+                        return found;
+                    });
+            }
+        }
+
+        // Objects for the sweep tests in an 800x576 room split into 32 pixel cells. Some stick out of the room.
+        // clusters > 0 puts them all in that many tight groups instead of spreading them out
+        struct SweepScene
+        {
+            Grid grid;
+            std::vector<std::unique_ptr<TestObject>> owned;
+            std::vector<BroadphaseItem> items;
+
+            SweepScene(std::mt19937& rng, int count, int clusters = 0)
+            {
+                grid.Generate(800, 576, 25, 18);
+                std::uniform_int_distribution<int> x(-20, 820);
+                std::uniform_int_distribution<int> y(-20, 596);
+                std::uniform_int_distribution<int> size(1, 32);
+                std::uniform_int_distribution<int> offset(-48, 48);
+                std::vector<sf::Vector2f> centers;
+                for (int c = 0; c < clusters; c++) centers.push_back(sf::Vector2f{ (float)x(rng), (float)y(rng) });
+                for (int i = 0; i < count; i++)
+                {
+                    owned.push_back(std::make_unique<TestObject>());
+                    sf::Vector2f p = clusters > 0 ? centers[i % clusters] + sf::Vector2f{ (float)offset(rng), (float)offset(rng) } : sf::Vector2f{ (float)x(rng), (float)y(rng) };
+                    RefShape s{ i % 2 ? COLLISIONTYPE::BOX : COLLISIONTYPE::CIRCLE, p.x, p.y, (float)size(rng), (float)size(rng), size(rng) * 0.5f, true };
+                    Apply(*owned.back(), s);
+                }
+                Refresh(rng, 0, 0);
+            }
+
+            // Moves everything up to jitter pixels and leaves each one out of items with chance dropRate
+            void Refresh(std::mt19937& rng, float jitter, float dropRate)
+            {
+                std::uniform_real_distribution<float> move(-jitter, jitter);
+                std::uniform_real_distribution<float> chance(0, 1);
+                items.clear();
+                for (auto& o : owned)
+                {
+                    if (jitter > 0) o->setPosition(o->getPosition() + sf::Vector2f{ move(rng), move(rng) });
+                    if (dropRate > 0 && chance(rng) < dropRate) continue;
+                    items.push_back(BroadphaseItem{ o->handle, o->getAABB(), o->group });
+                }
+            }
+        };
+
+        static std::vector<std::unique_ptr<Broadphase>> AllBackends(bool adaptive = true)
+        {
+            std::vector<std::unique_ptr<Broadphase>> backends;
+            backends.push_back(std::make_unique<UniformGridBroadphase>(32.0f));
+            backends.push_back(std::make_unique<UniformGridBroadphase>(128.0f));
+            backends.push_back(std::make_unique<SweepAndPruneBroadphase>());
+            backends.push_back(std::make_unique<QuadtreeBroadphase>());
+            if (adaptive) backends.push_back(std::make_unique<AdaptiveBroadphase>());
+            for (auto& b : backends) b->SetBounds(800, 576);
+            return backends;
+        }
+
+        // segmentCollides against the reference shapes sampled along the segment, then Bullet::Sweep against
+        // trying every object
+        static int CheckSweeps(std::mt19937& rng)
+        {
+            int failures = 0;
+            int cases = 0;
+            const int SAMPLES = 256;
+            std::uniform_int_distribution<int> coord(-320, 320);
+            for (int i = 0; i < 20000; i++)
+            {
+                cases++;
+                RefShape shape = RandomShape(rng, i % 2 ? COLLISIONTYPE::BOX : COLLISIONTYPE::CIRCLE);
+                TestObject o;
+                Apply(o, shape);
+                sf::Vector2f a{ coord(rng) * 0.25f, coord(rng) * 0.25f };
+                sf::Vector2f b = i % 10 == 0 ? a : sf::Vector2f{ coord(rng) * 0.25f, coord(rng) * 0.25f };
+
+                // First sample inside the shape, -1 for none
+                float firstInside = -1;
+                for (int k = 0; k <= SAMPLES && firstInside < 0; k++)
+                {
+                    float s = (float)k / SAMPLES;
+                    sf::Vector2f p = a + (b - a) * s;
+                    if (refColliding(RefShape{ COLLISIONTYPE::POINT, p.x, p.y, 0, 0, 0, false }, shape)) firstInside = s;
+                }
+
+                float t = -1;
+                bool hit = o.segmentCollides(a, b, t);
+                bool ok = true;
+                if (firstInside >= 0) ok = hit && t <= firstInside + 1e-4f && t >= firstInside - 1.0f / SAMPLES - 1e-4f;
+                if (hit)
+                {
+                    // Has to be on the shape's edge or inside it, allowing for rounding
+                    sf::Vector2f p = a + (b - a) * t;
+                    float distance;
+                    if (shape.type == COLLISIONTYPE::BOX)
+                    {
+                        AABB bb = shape.box();
+                        float dx = std::max({ bb.minX - p.x, 0.0f, p.x - bb.maxX });
+                        float dy = std::max({ bb.minY - p.y, 0.0f, p.y - bb.maxY });
+                        distance = std::sqrt(dx * dx + dy * dy);
+                    }
+                    else distance = (p - sf::Vector2f{ shape.x, shape.y }).length() - shape.r;
+                    ok = ok && t >= 0 && t <= 1 && distance <= 0.01f;
+                }
+                if (!ok) failures++;
+            }
+
+            // Every broadphase backend, with things moving and dying between updates
+            std::uniform_real_distribution<float> wide(-100, 900);
+            std::uniform_real_distribution<float> angle(0, 2 * 3.14159265f);
+            std::uniform_real_distribution<float> length(0, 600);
+            std::vector<EntityHandle> hits;
+            std::vector<EntityHandle> expected;
+            std::vector<EntityHandle> expectedFirst;
+            auto byHandle = [](EntityHandle x, EntityHandle y) { return x.value < y.value; };
+            for (int round = 0; round < 20; round++)
+            {
+                SweepScene scene(rng, 150, round % 2 == 0 ? 0 : 3);
+                std::vector<std::unique_ptr<Broadphase>> backends = AllBackends();
+                Bullet bullet;
+                bullet.grid = &scene.grid;
+                bullet.canDamage = { WORLD_GROUP::OTHER };
+                for (int step = 0; step < 3; step++)
+                {
+                    if (step > 0) scene.Refresh(rng, 10, 0.1f);
+                    for (auto& backend : backends) backend->Update(scene.items);
+
+                    for (int q = 0; q < 70; q++)
+                    {
+                        sf::Vector2f a{ wide(rng), wide(rng) * 0.72f };
+                        float r = angle(rng);
+                        // Some axis aligned ones, they run exactly along cell borders now and then
+                        if (q % 8 == 0) r = (q / 8 % 4) * 3.14159265f / 2;
+                        sf::Vector2f b = a + sf::Vector2f{ std::cos(r), std::sin(r) } * length(rng);
+
+                        float earliest = 2;
+                        expected.clear();
+                        expectedFirst.clear();
+                        for (const BroadphaseItem& item : scene.items)
+                        {
+                            float t;
+                            if (!entities.Resolve(item.handle)->segmentCollides(a, b, t)) continue;
+                            expected.push_back(item.handle);
+                            if (t < earliest || (t == earliest && item.handle.value < expectedFirst[0].value)) expectedFirst.assign(1, item.handle);
+                            earliest = std::min(earliest, t);
+                        }
+                        std::sort(expected.begin(), expected.end(), byHandle);
+
+                        for (auto& backend : backends)
+                        {
+                            cases++;
+                            bullet.broadphase = backend.get();
+                            bullet.Sweep(a, b, false, hits);
+                            bool ok = hits == expectedFirst;
+                            bullet.Sweep(a, b, true, hits);
+                            ok = ok && hits == expected;
+                            if (!ok) failures++;
+                        }
+
+                        // Box queries, with the group mask leaving everything out half the time
+                        AABB box{ std::min(a.x, b.x), std::max(a.x, b.x), std::min(a.y, b.y), std::max(a.y, b.y) };
+                        unsigned mask = q % 2 == 0 ? GroupBit(WORLD_GROUP::OTHER) : GroupBit(WORLD_GROUP::ENEMY);
+                        expected.clear();
+                        for (const BroadphaseItem& item : scene.items)
+                        {
+                            if (item.box.overlaps(box) && (mask & GroupBit(item.group)) != 0) expected.push_back(item.handle);
+                        }
+                        std::sort(expected.begin(), expected.end(), byHandle);
+                        for (auto& backend : backends)
+                        {
+                            cases++;
+                            hits.clear();
+                            backend->QueryBox(box, mask, hits);
+                            std::sort(hits.begin(), hits.end(), byHandle);
+                            if (hits != expected) failures++;
+                        }
+                    }
+                }
+            }
+            std::cout << "{\"test\":\"Sweep\",\"cases\":" << cases << ",\"failures\":" << failures << "}\n";
+            return failures;
+        }
+
+        // Bullet sized sweeps: 600 px/s at 60 and 15 ticks a second, and the old end point check for comparison
+        static void BenchSweeps(std::mt19937& rng)
+        {
+            SweepScene scene(rng, 256);
+            UniformGridBroadphase broadphase(32);
+            broadphase.SetBounds(800, 576);
+            broadphase.Update(scene.items);
+            Bullet bullet;
+            bullet.grid = &scene.grid;
+            bullet.broadphase = &broadphase;
+            bullet.canDamage = { WORLD_GROUP::OTHER };
+            std::uniform_real_distribution<float> x(0, 800);
+            std::uniform_real_distribution<float> y(0, 576);
+            std::uniform_real_distribution<float> angle(0, 2 * 3.14159265f);
+            std::vector<sf::Vector2f> starts;
+            std::vector<sf::Vector2f> dirs;
+            for (int i = 0; i < 4096; i++)
+            {
+                starts.push_back(sf::Vector2f{ x(rng), y(rng) });
+                float r = angle(rng);
+                dirs.push_back(sf::Vector2f{ std::cos(r), std::sin(r) });
+            }
+
+            std::vector<EntityHandle> hits;
+            const float dts[] = { 1.0f / 60, 1.0f / 15 };
+            for (float dt : dts)
+            {
+                std::string suffix = "/" + std::to_string((int)std::round(1 / dt)) + "hz";
+                Time(("Bullet.Sweep" + suffix).c_str(), 200000, [&](int ops)
+                    {
+                        int found = 0;
+                        for (int i = 0; i < ops; i++)
+                        {
+                            bullet.Sweep(starts[i % 4096], starts[i % 4096] + dirs[i % 4096] * (600 * dt), false, hits);
+                            found += (int)hits.size();
+                        }
+                        return found;
+                    });
+                UniformGridBroadphase endPointGrid(32);
+                endPointGrid.SetBounds(800, 576);
+                endPointGrid.Update(scene.items);
+                std::vector<EntityHandle> candidates;
+                Time(("Bullet.EndPoint" + suffix).c_str(), 200000, [&](int ops)
+                    {
+                        int found = 0;
+                        for (int i = 0; i < ops; i++)
+                        {
+                            sf::Vector2f end = starts[i % 4096] + dirs[i % 4096] * (600 * dt);
+                            candidates.clear();
+                            endPointGrid.QueryBox(AABB{ end.x, end.x, end.y, end.y }, GroupBit(WORLD_GROUP::OTHER), candidates);
+                            bullet.GameObject::setPosition(end);
+                            found += bullet.CheckForCollisionsAny(candidates) ? 1 : 0;
+                        }
+                        return found;
+                    });
+            }
+        }
+
+        // Every backend on evenly spread and clustered scenes: how long updates and bullet sweeps take, and how
+        // much work (item tests and cells or nodes visited) a sweep costs. Then what the adaptive one picks
+        static void BenchBroadphase(std::mt19937& rng)
+        {
+            std::uniform_real_distribution<float> x(0, 800);
+            std::uniform_real_distribution<float> y(0, 576);
+            std::uniform_real_distribution<float> angle(0, 2 * 3.14159265f);
+            std::vector<sf::Vector2f> starts;
+            std::vector<sf::Vector2f> ends;
+            for (int i = 0; i < 4096; i++)
+            {
+                sf::Vector2f a{ x(rng), y(rng) };
+                float r = angle(rng);
+                starts.push_back(a);
+                ends.push_back(a + sf::Vector2f{ std::cos(r), std::sin(r) } * (600.0f / 60));
+            }
+
+            std::vector<EntityHandle> out;
+            const char* layouts[] = { "uniform", "clustered" };
+            for (int layout = 0; layout < 2; layout++)
+            {
+                SweepScene scene(rng, 1024, layout == 0 ? 0 : 4);
+                std::vector<std::unique_ptr<Broadphase>> backends = AllBackends(false);
+                for (auto& backend : backends)
+                {
+                    std::string name = std::string("Broadphase.") + backend->Name() + "/" + layouts[layout];
+                    Time((name + ".Update").c_str(), 200, [&](int ops)
+                        {
+                            for (int i = 0; i < ops; i++) backend->Update(scene.items);
+                            return ops;
+                        });
+                    backend->stats.ResetWork();
+                    Time((name + ".QuerySegment").c_str(), 100000, [&](int ops)
+                        {
+                            int found = 0;
+                            for (int i = 0; i < ops; i++)
+                            {
+                                out.clear();
+                                backend->QuerySegment(starts[i % 4096], ends[i % 4096], GroupBit(WORLD_GROUP::OTHER), out);
+                                found += (int)out.size();
+                            }
+                            return found;
+                        });
+                    const BroadphaseStats& s = backend->stats;
+                    std::cout << "{\"work\":\"" << name << "\",\"tests_per_query\":" << (double)s.tests / s.queries << ",\"visits_per_query\":" << (double)s.visits / s.queries
+                        << ",\"max_per_bucket\":" << s.maxPerBucket << ",\"occupied\":" << s.occupied << ",\"buckets\":" << s.buckets << "}\n";
+                }
+
+                // Two tuning intervals of the same queries. Trying candidates is spread over the updates, so the
+                // slowest update shouldn't be far off the average
+                AdaptiveBroadphase adaptive;
+                adaptive.SetBounds(800, 576);
+                double totalNs = 0;
+                double slowestNs = 0;
+                for (int tick = 0; tick < AdaptiveBroadphase::TUNE_INTERVAL * 2; tick++)
+                {
+                    for (int i = 0; i < 64; i++)
+                    {
+                        out.clear();
+                        adaptive.QuerySegment(starts[(tick * 64 + i) % 4096], ends[(tick * 64 + i) % 4096], GroupBit(WORLD_GROUP::OTHER), out);
+                    }
+                    auto start = std::chrono::steady_clock::now();
+                    adaptive.Update(scene.items);
+                    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+                    totalNs += ns;
+                    slowestNs = std::max(slowestNs, ns);
+                }
+                std::cout << "{\"tuned\":\"Broadphase.auto/" << layouts[layout] << "\",\"picked\":\"" << adaptive.Name() << "\",\"update_ns\":"
+                    << totalNs / (AdaptiveBroadphase::TUNE_INTERVAL * 2) << ",\"slowest_update_ns\":" << slowestNs << "}\n";
+            }
+        }
+
+        static volatile int sink;
+
+        template <typename Fn>
+        static void Time(const char* name, int ops, Fn fn)
+        {
+            fn(ops / 10); // Warm the cache and branch predictors
+            auto start = std::chrono::steady_clock::now();
+            int hits = fn(ops);
+            double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+            sink = sink + hits;
+            std::cout << "{\"bench\":\"" << name << "\",\"ops\":" << ops << ",\"ns_per_op\":" << ns / ops << ",\"hit_rate\":" << (double)hits / ops << "}\n";
+        }
+
+        static void BenchPrimitives(std::mt19937& rng)
+        {
+            const int PAIRS = 1024;
+            const int OPS = 4000000;
+            std::vector<std::unique_ptr<TestObject>> boxes, circles, points;
+            for (int i = 0; i < PAIRS; i++)
+            {
+                boxes.push_back(std::make_unique<TestObject>());
+                Apply(*boxes.back(), RandomShape(rng, COLLISIONTYPE::BOX));
+                circles.push_back(std::make_unique<TestObject>());
+                Apply(*circles.back(), RandomShape(rng, COLLISIONTYPE::CIRCLE));
+                points.push_back(std::make_unique<TestObject>());
+                Apply(*points.back(), RandomShape(rng, COLLISIONTYPE::POINT));
+            }
+            TestObject& t = *boxes[0]; // The primitives take both operands explicitly
+
+            // Pair i with a different slot of the other list so no comparison is against itself
+            auto run = [&](auto test, auto& as, auto& bs)
+            {
+                return [&, test](int ops)
+                {
+                    int hits = 0;
+                    for (int i = 0; i < ops; i++) hits += (t.*test)(as[i & (PAIRS - 1)].get(), bs[(i * 7 + 1) & (PAIRS - 1)].get());
+                    return hits;
+                };
+            };
+            Time("ptCollidesBox", OPS, run(&GameObject::ptCollidesBox, points, boxes));
+            Time("ptCollidesCircle", OPS, run(&GameObject::ptCollidesCircle, points, circles));
+            Time("boxCollidesBox", OPS, run(&GameObject::boxCollidesBox, boxes, boxes));
+            Time("boxCollidesCircle", OPS, run(&GameObject::boxCollidesCircle, boxes, circles));
+            Time("circleCollidesCircle", OPS, run(&GameObject::circleCollidesCircle, circles, circles));
+        }
+
+        // Full dispatch path: one query against lists of growing size and shape mix
+        static void BenchBatches(std::mt19937& rng)
+        {
+            const int sizes[] = { 16, 256, 4096 };
+            const char* mixes[] = { "box", "circle", "mixed" };
+            for (int n : sizes)
+            {
+                for (int m = 0; m < 3; m++)
+                {
+                    std::vector<std::unique_ptr<TestObject>> objs;
+                    std::vector<EntityHandle> handles;
+                    for (int i = 0; i < n; i++)
+                    {
+                        COLLISIONTYPE type = m == 0 ? COLLISIONTYPE::BOX : m == 1 ? COLLISIONTYPE::CIRCLE : RandomType(rng, false);
+                        objs.push_back(std::make_unique<TestObject>());
+                        Apply(*objs.back(), RandomShape(rng, type));
+                        handles.push_back(objs.back()->handle);
+                    }
+                    TestObject query;
+                    Apply(query, RandomShape(rng, COLLISIONTYPE::POINT));
+
+                    std::string name = std::string("GetCollisionsAll/") + mixes[m] + "/" + std::to_string(n);
+                    int calls = std::max(1, 2000000 / n);
+                    std::vector<EntityHandle> colliding;
+                    Time(name.c_str(), calls * n, [&](int ops)
+                    {
+                        int hits = 0;
+                        for (int i = 0; i < ops / n; i++)
+                        {
+                            query.GetCollisionsAll(handles, colliding);
+                            hits += (int)colliding.size();
+                        }
+                        return hits;
+                    });
+                }
+            }
+        }
+};
+volatile int CollisionSelfTest::sink = 0;
+
+const std::string LEVEL_FILE = "level1.rooms";
+
+// Whole world state at the start of a tick
+struct WorldSnapshot
+{
+    int tick = -1;
+    PlayerState players[MAX_PLAYERS];
+    int score;
+    bool homing;
+    BULLET_HIT_POLICY bulletHitPolicy;
+    std::vector<SpawnState> enemies;
+    std::vector<BulletState> bullets;
+};
+
+// Everything one running game owns: the room, its grid and everything in it. Nothing in here knows
+// about the window, so any number of worlds can run side by side. A world has to be created, stepped
+// and destroyed on the same thread (entities and AABBs live in per-thread tables)
+class World
+{
+public:
+    Grid grid;
+    Player player;
+    Player coopPlayer; // Only used with 2 players
+    int numPlayers = 1;
+    BulletManager* bulletManager = nullptr;
+    EnemyManager* enemyManager = nullptr;
+    BehaviourScheduler behaviours;
+    DamageQueue damageQueue;
+    TargetBVH targets; // Enemies, as they were at the start of the tick
+    AdaptiveBroadphase broadphase; // Players and everything the room spawned, for bullets to hit
+    std::vector<BroadphaseItem> broadphaseItems;
+    std::vector<EntityHandle> visibleHandles; // Reused by DrawVisible, so drawing doesn't allocate
+    Room currentRoom;
+    int score = 0;
+    // Where sprites come from. Left null by headless worlds, so they never touch the atlas (which isn't
+    // thread safe) and can run on any thread
+    AssetCache* cache = nullptr;
+
+    World() {}
+    World(const World&) = delete;
+    World& operator=(const World&) = delete;
+
+    ~World()
+    {
+        behaviours.Clear();
+        delete enemyManager;
+        delete bulletManager;
+    }
+
+    // Builds the room and spawns what its file says. quiet turns off console output
+    void Init(const Room& room, int players, bool quiet = false)
+    {
+        currentRoom = room;
+        numPlayers = players;
+        GenerateGrid();
+
+        bulletManager = new BulletManager();
+        bulletManager->quiet = quiet;
+        bulletManager->Init(&grid, &player, &damageQueue, cache);
+        bulletManager->targets = &targets;
+        bulletManager->broadphase = &broadphase;
+
+        // Scoring: kills made by a player's bullets. Coins add their own value when picked up
+        damageQueue.listeners.push_back([this](const DamageEvent& e, GameObject*, bool killed)
+            {
+                if (!killed || (e.source != player.handle && e.source != coopPlayer.handle)) return;
+                score += 100;
+            });
+        // Effects: flash whatever got hit. Purely visual, so it is fine if a rollback replays it
+        damageQueue.listeners.push_back([](const DamageEvent&, GameObject* target, bool)
+            {
+                target->flashFrames = 4;
+            });
+
+        player.quiet = quiet;
+        player.Init(&grid, bulletManager, cache);
+        if (numPlayers > 1)
+        {
+            coopPlayer.quiet = quiet;
+            coopPlayer.Init(&grid, bulletManager, cache);
+            coopPlayer.color = sf::Color::Blue;
+            coopPlayer.setPosition(player.getPosition() + sf::Vector2f{ 0, 100 });
+        }
+
+        enemyManager = new EnemyManager(SpawnContext{ &grid, &player, bulletManager, &score, cache }, &behaviours);
+        enemyManager->ApplyRoomSpawns(currentRoom.spawns);
+        UpdateBroadphase();
+    }
+
+    // Swaps the room out from under the players. Nothing from the old room comes along
+    void EnterRoom(const Room& room, sf::Vector2f playerPosition)
+    {
+        behaviours.Clear();
+        bulletManager->Clear();
+        enemyManager->Clear();
+        currentRoom = room;
+        GenerateGrid();
+
+        player.setPosition(playerPosition);
+        if (numPlayers > 1) coopPlayer.setPosition(playerPosition + sf::Vector2f{ 0, 100 });
+        enemyManager->ApplyRoomSpawns(currentRoom.spawns);
+        UpdateBroadphase();
+    }
+
+    // Splits the current room into grid cells
+    void GenerateGrid()
+    {
+        int cols = std::max(1, (int)std::ceil(currentRoom.width / GRID_CELL_WIDTH));
+        int rows = std::max(1, (int)std::ceil(currentRoom.height / GRID_CELL_HEIGHT));
+        grid.Generate(currentRoom.width, currentRoom.height, cols, rows);
+        broadphase.SetBounds(currentRoom.width, currentRoom.height);
+    }
+
+    // Everything a bullet could hit, where it is right now
+    void UpdateBroadphase()
+    {
+        broadphaseItems.clear();
+        broadphaseItems.push_back(BroadphaseItem{ player.handle, player.getAABB(), player.group });
+        if (numPlayers > 1) broadphaseItems.push_back(BroadphaseItem{ coopPlayer.handle, coopPlayer.getAABB(), coopPlayer.group });
+        for (Spawnable* e : enemyManager->enemyList)
+        {
+            if (e->alive) broadphaseItems.push_back(BroadphaseItem{ e->handle, e->getAABB(), e->group });
+        }
+        broadphase.Update(broadphaseItems);
+    }
+
+    // Draws what the broadphase has inside the view, one group at a time so layering stays
+    // player -> enemies -> bullets. Cost depends on what is on screen, not on the size of the room
+    void DrawVisible(sf::FloatRect view)
+    {
+        AABB box = AABB{ view.position.x, view.position.x + view.size.x, view.position.y, view.position.y + view.size.y };
+        const WORLD_GROUP drawOrder[] = { WORLD_GROUP::WALL, WORLD_GROUP::OTHER, WORLD_GROUP::PLAYER, WORLD_GROUP::ENEMY };
+        for (WORLD_GROUP w_group : drawOrder)
+        {
+            visibleHandles.clear();
+            broadphase.QueryBoxUntracked(box, GroupBit(w_group), visibleHandles);
+            // Backends return them in different orders, this keeps overlapping sprites from swapping
+            std::sort(visibleHandles.begin(), visibleHandles.end(), [](EntityHandle a, EntityHandle b) { return a.value < b.value; });
+            for (EntityHandle h : visibleHandles)
+            {
+                GameObject* g = entities.Resolve(h);
+                if (g == nullptr || !g->alive) continue;
+                g->Draw();
+                if (g->flashFrames > 0) g->flashFrames--;
+            }
+        }
+        bulletManager->DrawBullets(box);
+    }
+
+    // Dumps every grid cell and what the broadphase has in it. Far too slow to call every frame
+    void PrintDebug()
+    {
+        std::cout << "[GRID]: " << grid._ROWS << "x" << grid._COLS << "\n";
+        for (int i = 0; i < (int)grid._grid.size(); i++)
+        {
+            GridCell& cell = grid.getByIndex(i);
+            sf::Vector2i coords = grid.index2Coords(i);
+            sf::Vector2f size = cell.getSize();
+            AABB box = AABB{ cell.topLeft.x, cell.topLeft.x + size.x, cell.topLeft.y, cell.topLeft.y + size.y };
+            std::cout << "CELL " << coords.y << ", " << coords.x << ":\n";
+            for (int j = 0; j <= static_cast<int>(WORLD_GROUP::OTHER); j++)
+            {
+                WORLD_GROUP w_group = static_cast<WORLD_GROUP>(j);
+                visibleHandles.clear();
+                broadphase.QueryBoxUntracked(box, GroupBit(w_group), visibleHandles);
+                if (visibleHandles.empty()) continue;
+                std::cout << "[[GROUP " << GroupName(w_group) << "]]:\n";
+                for (EntityHandle h : visibleHandles)
+                {
+                    GameObject* g = entities.Resolve(h);
+                    if (g != nullptr) std::cout << g->debugInfo() << "\n";
+                    else std::cout << "(stale handle)\n";
+                }
+            }
+        }
+    }
+
+    void Save(WorldSnapshot& out)
+    {
+        AllocScope scope(ALLOC_SCOPE::ROLLBACK);
+        out.players[0] = player.SaveState();
+        if (numPlayers > 1) out.players[1] = coopPlayer.SaveState();
+        out.score = score;
+        out.homing = bulletManager->homing;
+        out.bulletHitPolicy = damageQueue.bulletHitPolicy;
+        enemyManager->SaveState(out.enemies);
+        bulletManager->SaveState(out.bullets);
+    }
+
+    void Load(const WorldSnapshot& snapshot)
+    {
+        AllocScope scope(ALLOC_SCOPE::ROLLBACK);
+        player.LoadState(snapshot.players[0]);
+        if (numPlayers > 1) coopPlayer.LoadState(snapshot.players[1]);
+        score = snapshot.score;
+        bulletManager->homing = snapshot.homing;
+        damageQueue.bulletHitPolicy = snapshot.bulletHitPolicy;
+        enemyManager->LoadState(snapshot.enemies, snapshot.tick);
+        bulletManager->LoadState(snapshot.bullets);
+    }
+
+    // Rule switches pressed for this tick. Part of the simulation, so a replay flips them on the same tick again
+    void ApplyToggles(const PlayerInput& in)
+    {
+        if (in.toggleHoming)
+        {
+            bulletManager->homing = !bulletManager->homing;
+            if (!bulletManager->quiet) std::cout << "Homing bullets and auto-aim " << (bulletManager->homing ? "on" : "off") << "\n";
+        }
+        if (in.toggleHitPolicy)
+        {
+            bool all = damageQueue.bulletHitPolicy == BULLET_HIT_POLICY::ALL;
+            damageQueue.bulletHitPolicy = all ? BULLET_HIT_POLICY::FIRST : BULLET_HIT_POLICY::ALL;
+            if (!bulletManager->quiet) std::cout << "Bullets now damage " << (all ? "the first thing they hit" : "everything they hit") << "\n";
+        }
+    }
+
+    // Advances the game by one fixed tick. Everything that affects gameplay has to happen in here and only
+    // depend on the world state and inputs, otherwise replaying a tick after a rollback gives a different result
+    void Step(const PlayerInput* inputs, int tick)
+    {
+        {
+            // First, so every query this tick sees the same enemy positions, and a replayed tick builds it
+            // from the restored state rather than whatever the tree held before the rollback
+            AllocScope scope(ALLOC_SCOPE::ENEMIES);
+            targets.Update(enemyManager->enemyList);
+        }
+        for (int p = 0; p < numPlayers; p++) ApplyToggles(inputs[p]);
+        {
+            AllocScope scope(ALLOC_SCOPE::PLAYER);
+            player.input = inputs[0];
+            player.Update(TICK_DT);
+            if (numPlayers > 1)
+            {
+                coopPlayer.input = inputs[1];
+                coopPlayer.Update(TICK_DT);
+            }
+        }
+        {
+            AllocScope scope(ALLOC_SCOPE::ENEMIES);
+            enemyManager->Update(TICK_DT);
+            behaviours.Tick(tick);
+        }
+        {
+            // After everything else moved, so bullets hit things where they are now
+            AllocScope scope(ALLOC_SCOPE::BULLETS);
+            UpdateBroadphase();
+            bulletManager->Update(TICK_DT);
+        }
+        {
+            // All the hits from this tick get applied together
+            AllocScope scope(ALLOC_SCOPE::DAMAGE);
+            damageQueue.Resolve();
+        }
+    }
+};
+
+// References
+sf::Clock game_clock;
+World* world; // The one being played
+Camera camera;
+RoomFile level;
+RoomFileWatcher roomWatcher;
+
+// --procgen <seed> plays an endless generated level instead of LEVEL_FILE
+bool proceduralLevel = false;
+RoomStreamer roomStreamer;
+RoomCoord currentCoord;
+const float ROOM_ENTRY_INSET = 48; // How far into the next room the player appears
+
+// --broadphase <name> fixes every world to one backend. Empty picks automatically
+std::string broadphaseBackend;
+
+void SelectBroadphase(World& w)
+{
+    if (broadphaseBackend.empty()) return;
+    if (!w.broadphase.Select(broadphaseBackend)) std::cout << "[BROADPHASE]: no backend called " << broadphaseBackend << ", picking automatically\n";
+}
+
+// Input for one player on one tick, as it travels over the network
+struct InputPacket
+{
+    int player;
+    int tick;
+    PlayerInput input;
+};
+
+// Fake network connection between two endpoints in the same process. Packets arrive after
+// LOOPBACK_LATENCY +/- LOOPBACK_JITTER seconds, so they can also arrive out of order
+class LoopbackTransport
+{
+public:
+    // endpoint is 0 or 1, packets go to the other one
+    void Send(int endpoint, const InputPacket& packet)
+    {
+        float delay = latency + jitterDist(rng) * jitter;
+        inFlight[1 - endpoint].push_back({ packet, now() + std::max(0.0f, delay) });
+    }
+
+    // Returns false when nothing else has arrived yet
+    bool Receive(int endpoint, InputPacket& out)
+    {
+        std::vector<Delayed>& queue = inFlight[endpoint];
+        double t = now();
+        for (int i = 0; i < (int)queue.size(); i++)
+        {
+            if (queue[i].deliverAt <= t)
+            {
+                out = queue[i].packet;
+                queue[i] = queue.back();
+                queue.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Init(float _latency, float _jitter, unsigned seed)
+    {
+        latency = _latency;
+        jitter = _jitter;
+        rng.seed(seed);
+        clock.restart();
+    }
+
+private:
+    struct Delayed
+    {
+        InputPacket packet;
+        double deliverAt;
+    };
+    std::vector<Delayed> inFlight[2];
+    float latency = 0;
+    float jitter = 0;
+    std::mt19937 rng;
+    std::uniform_real_distribution<float> jitterDist = std::uniform_real_distribution<float>(-1.0f, 1.0f);
+    sf::Clock clock;
+
+    double now() { return clock.getElapsedTime().asSeconds(); }
+};
+
+// Stands in for the remote player in loopback tests: walks in a square and fires now and then
+// PATROL: walk a square and fire on a timer. WANDER: pick a random direction every so often, fire at random
+enum class BOT_STYLE {PATROL, WANDER};
+
+// Input for a player nobody is controlling. The same seed always gives the same inputs
+class BotInput
+{
+public:
+    BOT_STYLE style = BOT_STYLE::PATROL;
+
+    void Init(BOT_STYLE s, unsigned int seed)
+    {
+        style = s;
+        rng.seed(seed);
+        nextTurn = 0;
+    }
+
+    PlayerInput Next(int tick)
+    {
+        PlayerInput in;
+        if (style == BOT_STYLE::PATROL)
+        {
+            int side = (tick / 90) % 4;
+            in.x = side == 0 ? 1 : (side == 2 ? -1 : 0);
+            in.y = side == 1 ? 1 : (side == 3 ? -1 : 0);
+            in.fire = tick % 20 == 0;
+            return in;
+        }
+
+        if (tick >= nextTurn)
+        {
+            std::uniform_int_distribution<int> axis(-1, 1);
+            std::uniform_int_distribution<int> hold(20, 120);
+            dirX = (signed char)axis(rng);
+            dirY = (signed char)axis(rng);
+            nextTurn = tick + hold(rng);
+        }
+        std::uniform_int_distribution<int> shot(0, 9);
+        in.x = dirX;
+        in.y = dirY;
+        in.fire = shot(rng) == 0;
+        return in;
+    }
+
+private:
+    std::mt19937 rng;
+    int nextTurn = 0;
+    signed char dirX = 0;
+    signed char dirY = 0;
+};
 
-        _timer += dt;
-        return 0;
+class LoopbackBot
+{
+public:
+    LoopbackTransport* transport;
+    int endpoint = 1;
+    int playerIndex = 1;
+    BotInput bot;
 
+    void Tick(int tick)
+    {
+        InputPacket incoming;
+        while (transport->Receive(endpoint, incoming)) {} // The bot doesn't care what the other side does
+        transport->Send(endpoint, InputPacket{ playerIndex, tick, bot.Next(tick) });
     }
+};
 
-    virtual void Fire()
+// Runs the world in fixed ticks, predicting remote inputs that haven't arrived yet (by repeating the
+// previous one). When a real input turns out different from the prediction, the world is put back to
+// that tick and replayed up to now. Can go back at most MAX_ROLLBACK_FRAMES ticks.
+// Replaying gets at most RESIM_BUDGET_MS a call. A replay that doesn't fit is carried on in the next call,
+// and the game stalls (no new tick) until it has caught up, so a slow replay costs frames, never a desync
+class RollbackSession
+{
+public:
+    // Half a frame, the rest is for the new tick and recording the frame
+    static inline const float RESIM_BUDGET_MS = TICK_DT * 1000.0f / 2;
+
+    int localPlayer = 0;
+    int currentTick = 0; // Next tick to simulate
+    World* world = nullptr;
+    LoopbackTransport* transport = nullptr;
+    int endpoint = 0;
+
+    // Stats
+    int rollbacks = 0;
+    int lateInputs = 0; // Arrived too late to roll back to, the players are out of sync after one of these
+    float lastResimMs = 0;
+    float maxResimMs = 0;
+    int stalls = 0; // Calls that spent their budget replaying and didn't get to a new tick
+
+    void Init(World* w, LoopbackTransport* t)
     {
-        fireTimer = 0;
-        //std::cout << "Enemy fire bullet!";
-        sf::Vector2f direction = player->getPosition() - getPosition();
-        
-        //if (player->getPosition().x <= getPosition().x) _dir.x = -1;
-        //else _dir.x = 1;
+        world = w;
+        transport = t;
+        for (WorldSnapshot& s : snapshots) s.tick = -1;
+        for (InputSlot& slot : inputs) slot.tick = -1;
+        oldestTick = currentTick;
+        replayTick = currentTick;
+    }
 
-        
-        bulletManager->createBullet(1, getPosition(), direction.normalized(), this);
-        //EnemyBulletManager.SpawnBullet
+    // Forget the history, e.g. after the room was reloaded and old snapshots no longer fit it
+    void Reset()
+    {
+        oldestTick = currentTick;
+        replayTick = currentTick;
     }
 
-    bool collidesWithPt(sf::Vector2f pt)
+    // True while a replay is carried over between calls. The world is behind currentTick until it is done
+    bool Replaying() const
     {
-        sf::RectangleShape r = sf::RectangleShape(sf::Vector2f({ r_Size, r_Size }));
-        //r.setFillColor(sf::Color::Yellow);
-        //r.setOutlineThickness(2.0f);
-        r.setOrigin(sf::Vector2f({ r_Size / 2, r_Size / 2 }));
-        r.setPosition(getPosition());
-        return r.getGlobalBounds().contains(pt);
+        return replayTick < currentTick;
     }
-};
 
-class Enemy360Shot : public Enemy
-{
-    public:
-        
-        Enemy360Shot()
+    // Simulates the next tick with local as this player's input. Returns false if it stalled instead: a replay
+    // didn't fit in the budget, local was not used and the tick is still to come
+    bool AdvanceTick(PlayerInput local)
+    {
+        int rollbackTo = replayTick;
+        InputPacket packet;
+        while (transport != nullptr && transport->Receive(endpoint, packet))
         {
-            this->distanceToFire = 300;
+            if (packet.tick < std::max(oldestTick, currentTick - MAX_ROLLBACK_FRAMES))
+            {
+                lateInputs++;
+                continue;
+            }
+            if (packet.tick >= currentTick + INPUT_RING - MAX_ROLLBACK_FRAMES - 2) continue; // Too far ahead to store
+            InputSlot& slot = slotFor(packet.tick);
+            // Ticks we already simulated used a prediction, replay from there if it was wrong
+            if (packet.tick < replayTick && slot.inputs[packet.player] != packet.input) rollbackTo = std::min(rollbackTo, packet.tick);
+            slot.inputs[packet.player] = packet.input;
+            slot.confirmed[packet.player] = true;
         }
 
-        int Update(float dt) override
+        if (rollbackTo < replayTick)
         {
-            //std::cout << "In enemy update\n";
-            //y = y_center + amplitude * std::sin(_timer * timeScale);
-            //this->setPosition(sf::Vector2f{ getPosition().x, y });
-            float dist = (getPosition() - player->getPosition()).length();
-            if (dist <= distanceToFire && fireTimer >= fireWaitTime)
+            world->Load(snapshotFor(rollbackTo));
+            replayTick = rollbackTo;
+            replayMs = 0;
+            rollbacks++;
+        }
+
+        if (replayTick < currentTick)
+        {
+            // Always at least one tick, so a replay finishes however slow ticks get
+            auto start = std::chrono::steady_clock::now();
+            float spent = 0;
+            float tickMs = 0;
+            while (replayTick < currentTick && (spent == 0 || spent + tickMs <= RESIM_BUDGET_MS))
             {
-                Fire();
+                Simulate(replayTick);
+                replayTick++;
+                float now = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+                tickMs = std::max(tickMs, now - spent);
+                spent = now;
             }
-            else fireTimer += dt;
-            //std::cout << "Distance to player " << dist << "\n";
+            replayMs += spent;
+            if (replayTick < currentTick)
+            {
+                if (stalls++ == 0) std::cout << "[ROLLBACK]: replay over the " << RESIM_BUDGET_MS << "ms budget, stalling until it catches up\n";
+                return false;
+            }
+            lastResimMs = replayMs;
+            maxResimMs = std::max(maxResimMs, lastResimMs);
+        }
 
-            _timer += dt;
+        InputSlot& mine = slotFor(currentTick);
+        mine.inputs[localPlayer] = local;
+        mine.confirmed[localPlayer] = true;
+        if (transport != nullptr) transport->Send(endpoint, InputPacket{ localPlayer, currentTick, local });
+
+        Simulate(currentTick);
+        currentTick++;
+        replayTick = currentTick;
+        return true;
+    }
+
+    // Worst case check: rolls back the full MAX_ROLLBACK_FRAMES and replays them. Returns how long it took in ms
+    float MeasureWorstCase()
+    {
+        int from = std::max(oldestTick, currentTick - MAX_ROLLBACK_FRAMES);
+        if (from == currentTick)
+        {
+            // Straight after a reset nothing has been saved yet
+            std::cout << "[ROLLBACK]: no ticks to replay yet\n";
             return 0;
         }
-
-        void Fire() override
+        auto start = std::chrono::steady_clock::now();
+        world->Load(snapshotFor(from));
+        for (int t = from; t < currentTick; t++)
         {
-            fireTimer = 0;
-            //std::cout << "Enemy fire bullet!";
-            sf::Vector2f direction = player->getPosition() - getPosition();
-
-            //if (player->getPosition().x <= getPosition().x) _dir.x = -1;
-            //else _dir.x = 1;
+            Simulate(t);
+        }
+        float ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+        replayTick = currentTick; // Whatever was still to replay is done now
+        std::cout << "[ROLLBACK]: replaying " << currentTick - from << " ticks took " << ms << "ms (budget " << RESIM_BUDGET_MS << "ms a frame, "
+            << stalls << " stalls so far)\n";
+        return ms;
+    }
 
+private:
+    static const int INPUT_RING = 128; // Has to hold inputs that arrive ahead of us too
 
-            bulletManager->createBullet(1, getPosition(), direction.normalized(), this);
-            //EnemyBulletManager.SpawnBullet
+    struct InputSlot
+    {
+        int tick = -1;
+        PlayerInput inputs[MAX_PLAYERS];
+        bool confirmed[MAX_PLAYERS] = {};
+    };
+
+    InputSlot inputs[INPUT_RING];
+    WorldSnapshot snapshots[MAX_ROLLBACK_FRAMES + 1];
+    int oldestTick = 0; // Can't roll back before this
+    int replayTick = 0; // Next tick a replay in progress has to redo. currentTick when there isn't one
+    float replayMs = 0; // Time spent on the replay in progress so far
+
+    InputSlot& slotFor(int tick)
+    {
+        InputSlot& slot = inputs[tick % INPUT_RING];
+        if (slot.tick != tick)
+        {
+            slot = InputSlot();
+            slot.tick = tick;
         }
+        return slot;
+    }
 
-        void Draw() override
-        {
-            sf::RectangleShape r = sf::RectangleShape(sf::Vector2f({ r_Size, r_Size }));
-            r.setFillColor(sf::Color::Green);
-            //r.setOutlineThickness(2.0f);
-            r.setOrigin(sf::Vector2f({ r_Size / 2, r_Size / 2 }));
-            r.setPosition(getPosition());
-            window->draw(r);
+    WorldSnapshot& snapshotFor(int tick)
+    {
+        WorldSnapshot& s = snapshots[tick % (MAX_ROLLBACK_FRAMES + 1)];
+        if (s.tick != tick) throw std::runtime_error("No snapshot for tick " + std::to_string(tick));
+        return s;
+    }
 
+    // Saves the state going into tick t, fills in predictions for missing inputs and steps
+    void Simulate(int t)
+    {
+        WorldSnapshot& s = snapshots[t % (MAX_ROLLBACK_FRAMES + 1)];
+        world->Save(s);
+        s.tick = t;
+
+        InputSlot& slot = slotFor(t);
+        InputSlot& previous = slotFor(t - 1 < 0 ? 0 : t - 1);
+        for (int p = 0; p < world->numPlayers; p++)
+        {
+            if (!slot.confirmed[p])
+            {
+                slot.inputs[p] = previous.tick == t - 1 ? previous.inputs[p] : PlayerInput();
+                slot.inputs[p].fire = false; // Guessing a shot is worse than missing one for a few frames
+                slot.inputs[p].toggleHoming = false; // Same for switches, a repeated one would switch back
+                slot.inputs[p].toggleHitPolicy = false;
+            }
         }
+        world->Step(slot.inputs, t);
+    }
 };
 
-class EnemyManager
+LoopbackTransport loopback;
+LoopbackBot loopbackBot;
+RollbackSession session;
+bool fireQueued = false; // Set by the key event, cleared once a tick has taken it
+bool homingToggleQueued = false; // Same for the rule switches
+bool hitPolicyToggleQueued = false;
+
+// Reads the keyboard into the input for the next tick
+PlayerInput SampleLocalInput()
 {
-    private:
-        Grid* grid;
-        Player* player;
-        BulletManager* bulletManager;
+    PlayerInput in;
+    if (sf::Keyboard::isKeyPressed(sf::Keyboard::Key::Right)) in.x += 1;
+    if (sf::Keyboard::isKeyPressed(sf::Keyboard::Key::Left)) in.x -= 1;
+    if (sf::Keyboard::isKeyPressed(sf::Keyboard::Key::Down)) in.y += 1;
+    if (sf::Keyboard::isKeyPressed(sf::Keyboard::Key::Up)) in.y -= 1;
+    in.strafe = sf::Keyboard::isKeyPressed(Keybindings::STRAFE);
+    in.fire = fireQueued;
+    in.toggleHoming = homingToggleQueued;
+    in.toggleHitPolicy = hitPolicyToggleQueued;
+    return in;
+}
 
-    public:
-        std::vector<Enemy*> enemyList;
+// Applies a re-parsed level file to the room being played. Only what changed gets touched,
+// so enemies that are still there keep their state
+void ApplyLevelReload(RoomFile& reloaded)
+{
+    AllocScope scope(ALLOC_SCOPE::ROOMS);
+    Room& currentRoom = world->currentRoom;
+    Player& player = world->player;
+    Room* room = reloaded.findRoom(currentRoom.name);
+    if (room == nullptr)
+    {
+        std::cout << "[ROOMS]: room " << currentRoom.name << " is gone from the file, keeping the old one\n";
+        return;
+    }
+
+    if (room->bg != currentRoom.bg)
+    {
+        currentRoom.bg = room->bg;
+        currentRoom.background = assets.Request(room->bg);
+    }
+    currentRoom.description = room->description;
+    currentRoom.neighbors = room->neighbors;
+
+    if (room->width != currentRoom.width || room->height != currentRoom.height)
+    {
+        currentRoom.width = room->width;
+        currentRoom.height = room->height;
+        // Bullets could be anywhere in the old bounds
+        world->bulletManager->Clear();
+        world->GenerateGrid();
+        player.setPosition(sf::Vector2f{ std::clamp(player.getPosition().x, 0.0f, currentRoom.width), std::clamp(player.getPosition().y, 0.0f, currentRoom.height) });
+    }
+
+    currentRoom.spawns = room->spawns;
+    world->enemyManager->ApplyRoomSpawns(currentRoom.spawns);
+    world->UpdateBroadphase();
+    level = std::move(reloaded);
+    // Old snapshots have a different set of enemies
+    session.Reset();
+}
 
-        EnemyManager(Grid* g, Player* p, BulletManager* bm)
+// Runs lots of headless worlds at once, for balance testing and bots. Each thread builds, steps and
+// destroys its own share of the worlds, so the threads never touch the same data. Worlds are stepped
+// in lockstep, one tick for all of them at a time
+class BatchRunner
+{
+public:
+    // Worlds cycle through rooms (the default room if there are none). World i is seeded with seed + i,
+    // and even worlds wander while odd ones patrol
+    void Run(const std::vector<Room>& rooms, int worldCount, int ticks, int threadCount, unsigned int seed)
+    {
+        threadCount = std::max(1, std::min(threadCount, worldCount));
+        std::vector<Room> playable = rooms;
+        if (playable.empty()) playable.push_back(Room());
+        // Worlds would each complain about spawns they can't build
+        for (Room& r : playable)
         {
-            grid = g;
-            player = p;
-            bulletManager = bm;
+            std::erase_if(r.spawns, [](const RoomSpawn& spawn) { return SpawnRegistry::Find(spawn.type) < 0; });
         }
 
-        void createEnemy(sf::Vector2f location, int type=0)
+        std::vector<Totals> totals(threadCount);
+        std::vector<std::thread> threads;
+        auto start = std::chrono::steady_clock::now();
+        for (int t = 0; t < threadCount; t++)
         {
-            if (type == 0)
-            {
-                Enemy* e = new Enemy();
-                e->Init(grid, location, player, bulletManager);
-                enemyList.push_back(e);
-            }
-            else if (type == 1)
-            {
-                Enemy360Shot* e = new Enemy360Shot();
-                e->Init(grid, location, player, bulletManager);
-                enemyList.push_back(e);
-            }
-            else throw std::runtime_error("Unknown enemy type");
+            threads.emplace_back([&, t]() { RunShard(playable, t, threadCount, worldCount, ticks, seed, totals[t]); });
         }
+        for (std::thread& thread : threads) thread.join();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-        void Update(float dt)
+        Totals sum;
+        double slowest = 0;
+        for (const Totals& t : totals)
         {
-            for (Enemy* e : enemyList)
-            {
-                e->Update(dt);
-            }
-            //debugPrint();
+            sum.ticks += t.ticks;
+            sum.score += t.score;
+            sum.deaths += t.deaths;
+            sum.enemiesAlive += t.enemiesAlive;
+            slowest = std::max(slowest, t.seconds);
         }
+        std::cout << "[BATCH]: " << worldCount << " worlds x " << ticks << " ticks on " << threadCount << " threads in " << seconds << "s: "
+            << (long long)(sum.ticks / seconds) << " ticks/s, " << (long long)(sum.ticks / seconds / threadCount) << " per thread (slowest thread " << slowest << "s)\n";
+        std::cout << "[BATCH]: per world: score " << (double)sum.score / worldCount << ", player deaths " << (double)sum.deaths / worldCount
+            << ", enemies left " << (double)sum.enemiesAlive / worldCount << "\n";
+    }
 
-        void Draw()
+private:
+    struct Totals
+    {
+        long long ticks = 0;
+        long long score = 0;
+        long long deaths = 0;
+        long long enemiesAlive = 0;
+        double seconds = 0;
+    };
+
+    static void RunShard(const std::vector<Room>& rooms, int shard, int shardCount, int worldCount, int ticks, unsigned int seed, Totals& out)
+    {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::unique_ptr<World>> worlds;
+        std::vector<BotInput> bots;
+        for (int i = shard; i < worldCount; i += shardCount)
         {
-            for (Enemy* e : enemyList)
-            {
-                e->Draw();
-            }
+            worlds.push_back(std::make_unique<World>());
+            worlds.back()->Init(rooms[i % rooms.size()], 1, true);
+            SelectBroadphase(*worlds.back());
+            bots.push_back(BotInput());
+            bots.back().Init(i % 2 == 0 ? BOT_STYLE::WANDER : BOT_STYLE::PATROL, seed + i);
         }
 
-        void debugPrint()
+        PlayerInput inputs[MAX_PLAYERS];
+        for (int tick = 0; tick < ticks; tick++)
         {
-            std::cout << "enemyList: ";
-            for (int i = 0; i < enemyList.size(); i++)
+            for (int w = 0; w < (int)worlds.size(); w++)
             {
-                std::cout << enemyList[i]->debugInfo() << ",";
+                inputs[0] = bots[w].Next(tick);
+                worlds[w]->Step(inputs, tick);
             }
-            std::cout << "\n";
         }
-};
-
 
-
-// References
-sf::Clock game_clock;
-Player player;
-//
-EnemyManager* enemyManager;
-Grid grid;
-BulletManager* bulletManager;
+        for (const std::unique_ptr<World>& w : worlds)
+        {
+            out.ticks += ticks;
+            out.score += w->score;
+            out.deaths += w->player.deaths;
+            for (Spawnable* e : w->enemyManager->enemyList) out.enemiesAlive += e->alive && e->group == WORLD_GROUP::ENEMY ? 1 : 0;
+        }
+        worlds.clear(); // Has to happen on this thread
+        out.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+};
 
 void Init()
 {
 
     window = new sf::RenderWindow(sf::VideoMode({ SCREEN_WIDTH, SCREEN_HEIGHT }), "TOP DOWN SHOOTER");
-    grid.Generate(SCREEN_WIDTH, SCREEN_HEIGHT, 2, 1);
 
-    bulletManager = new BulletManager();
-    bulletManager->Init(&grid, &player);
-    player.Init(&grid, bulletManager);
+    Room room;
+    bool levelLoaded = false;
+    try
+    {
+        level = RoomParser::ParseFile(LEVEL_FILE);
+        if (!level.rooms.empty())
+        {
+            room = level.rooms[0];
+            levelLoaded = true;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << "[ROOMS]: " << e.what() << ", using the default room\n";
+    }
+    if (proceduralLevel)
+    {
+        // The start room is made here so the first frame has something, the rest come from the worker
+        roomStreamer.generator.roomWidth = level.roomWidth;
+        roomStreamer.generator.roomHeight = level.roomHeight;
+        roomStreamer.generator.tileSize = level.gridSize;
+        currentCoord = RoomCoord{ 0, 0 };
+        room = roomStreamer.generator.Generate(currentCoord);
+        roomStreamer.Start(currentCoord);
+        levelLoaded = true;
+    }
+    camera.Init(sf::Vector2f{ SCREEN_WIDTH, SCREEN_HEIGHT });
+
+    assets.Init();
+    spriteBatch.cache = &assets;
+
+    world = new World();
+    world->cache = &assets;
+    world->Init(room, LOOPBACK_COOP_TEST ? 2 : 1);
+    SelectBroadphase(*world);
+    world->currentRoom.background = assets.Request(world->currentRoom.bg);
+    if (LOOPBACK_COOP_TEST)
+    {
+        loopback.Init(LOOPBACK_LATENCY, LOOPBACK_JITTER, 1234);
+        loopbackBot.transport = &loopback;
+        session.Init(world, &loopback);
+    }
+    else session.Init(world, nullptr);
 
-    enemyManager = new EnemyManager(&grid, &player, bulletManager);
-    enemyManager->createEnemy(player.getPosition() + sf::Vector2f{ 200, 0 });
-    enemyManager->createEnemy(player.getPosition() + sf::Vector2f{ -100, 0 }, 1);
+    if (levelLoaded && !proceduralLevel) roomWatcher.Start(LEVEL_FILE);
+    else if (!levelLoaded)
+    {
+        sf::Vector2f p = world->player.getPosition();
+        world->enemyManager->createEnemy<Enemy>(p + sf::Vector2f{ 200, 0 });
+        world->enemyManager->createEnemy<Enemy360Shot>(p + sf::Vector2f{ -100, 0 });
+    }
 
     //enemy0.Init(&grid, player.getPosition() + sf::Vector2f{ 200, 0 }, &player, bulletManager);
     //enemy1.Init(&grid, player.getPosition() + sf::Vector2f{ 200, 0 }, &player, bulletManager);
     
 }
 
+// Walking off the edge of a room with a neighbor on that side goes into it. If a generated room isn't
+// ready yet the player just waits at the edge for a frame or two
+void CheckRoomExit()
+{
+    Player& player = world->player;
+    Room& room = world->currentRoom;
+    sf::Vector2f pos = player.getPosition();
+    std::string side;
+    if (pos.x <= 0) side = "left";
+    else if (pos.x >= room.width) side = "right";
+    else if (pos.y <= 0) side = "up";
+    else if (pos.y >= room.height) side = "down";
+    auto link = room.neighbors.find(side);
+    if (side.empty() || link == room.neighbors.end()) return;
+
+    Room next;
+    RoomCoord offset = NeighborOffset(side);
+    if (proceduralLevel)
+    {
+        if (!roomStreamer.TryGet(currentCoord + offset, next)) return;
+        currentCoord = currentCoord + offset;
+        roomStreamer.Focus(currentCoord);
+    }
+    else
+    {
+        Room* found = level.findRoom(link->second);
+        if (found == nullptr) return;
+        next = *found;
+    }
+
+    AllocScope scope(ALLOC_SCOPE::ROOMS);
+    // Come in on the opposite edge, same distance along it
+    sf::Vector2f entry{ std::clamp(pos.x, ROOM_ENTRY_INSET, next.width - ROOM_ENTRY_INSET), std::clamp(pos.y, ROOM_ENTRY_INSET, next.height - ROOM_ENTRY_INSET) };
+    if (offset.x < 0) entry.x = next.width - ROOM_ENTRY_INSET;
+    if (offset.x > 0) entry.x = ROOM_ENTRY_INSET;
+    if (offset.y < 0) entry.y = next.height - ROOM_ENTRY_INSET;
+    if (offset.y > 0) entry.y = ROOM_ENTRY_INSET;
+    world->EnterRoom(next, entry);
+    world->currentRoom.background = assets.Request(next.bg);
+    // Old snapshots are of the other room
+    session.Reset();
+    std::cout << "[ROOMS]: entered " << next.name << "\n";
+}
+
+float tickAccumulator = 0;
+
 void Update(float dt)
 {
-    //int _ind = *player.gridPartitions.begin();
-    //std::cout << "Isactive: " << player.grid->getByIndex(_ind).isActive << "\n";
-    grid.printDebug();
+    // Parsing happens on the watcher thread, this just picks up the result
+    // Not in the middle of a replay though, the world is still on an older tick and resetting the session
+    // would drop the rest of it. The update waits in the watcher until the replay is done
+    RoomFile reloaded;
+    if (!session.Replaying() && roomWatcher.TakeUpdate(reloaded)) ApplyLevelReload(reloaded);
+
     //GameObject* p = &player;
     //std::cout << p->debugInfo() << "\n";
-    player.Update(dt);
-    enemyManager->Update(dt);
-    bulletManager->Update(dt);
+
+    // Run however many fixed ticks fit in the time that passed
+    tickAccumulator += dt;
+    int ticks = 0;
+    while (tickAccumulator >= TICK_DT && ticks < MAX_TICKS_PER_FRAME)
+    {
+        if (world->numPlayers > 1) loopbackBot.Tick(session.currentTick);
+        if (!session.AdvanceTick(SampleLocalInput())) break; // Stalled on a replay, try again next frame
+        fireQueued = false;
+        homingToggleQueued = false;
+        hitPolicyToggleQueued = false;
+        tickAccumulator -= TICK_DT;
+        ticks++;
+    }
+    if (ticks == MAX_TICKS_PER_FRAME) tickAccumulator = 0; // Fell too far behind, drop the rest
+    // Same as the reload, the player is only where they really are once the replay has caught up
+    if (!session.Replaying()) CheckRoomExit();
+    camera.Follow(world->player.getPosition(), world->currentRoom.getSize());
     // Do bullet collisions
     //bulletManager->CollisionCheck();
 }
 
-void RenderGrid()
+// Records the frame on the simulation thread. Nothing here touches the window
+void Draw(RenderSnapshot& frame)
 {
-    // Top left
-    sf::RectangleShape r1(sf::Vector2f({ SCREEN_WIDTH / 2, SCREEN_HEIGHT / 2 }));
-    r1.setFillColor(regionActiveColor);
-    r1.setPosition(sf::Vector2f(0,0));
-    r1.setOutlineThickness(1.0f); 
-    r1.setOutlineColor(sf::Color::Black);
-    window->draw(r1);
-    
-    // Top right
-    r1.setFillColor(regionNormalColor);
-    r1.setPosition(sf::Vector2f(SCREEN_WIDTH / 2, 0));
-    window->draw(r1);
-
-    // bottom right
-    r1.setFillColor(regionNormalColor);
-    r1.setPosition(sf::Vector2f(SCREEN_WIDTH / 2, SCREEN_HEIGHT/2));
-    window->draw(r1);
-
-    // bottom LEFT
-    r1.setFillColor(regionNormalColor);
-    r1.setPosition(sf::Vector2f(0, SCREEN_HEIGHT / 2));
-    window->draw(r1);
+    AllocScope scope(ALLOC_SCOPE::RENDER);
+    frame.view = camera.view;
+    sf::FloatRect visible = camera.getVisibleRect();
+    // Everything goes into one batch and gets drawn with the atlas in a single call
+    spriteBatch.Begin(frame);
+    Room& room = world->currentRoom;
+    bool hasBackground = assets.isLoaded(room.background);
+    if (hasBackground) spriteBatch.Add(room.background, sf::Vector2f(), room.getSize(), sf::Vector2f(), sf::Color::White);
+    AABB playerBoxes[2] = { world->player.getAABB(), world->coopPlayer.getAABB() };
+    world->grid.RenderGrid(visible, !hasBackground, std::span<const AABB>(playerBoxes, world->numPlayers));
+    // Only what is inside the view gets drawn
+    world->DrawVisible(visible);
+    //player.DrawBullets();
 }
 
-void Draw()
+// Draws a recorded frame. Only called from whichever thread owns the window's GL context
+void Present(const RenderSnapshot& frame)
 {
-    grid.RenderGrid();
-    //RenderGrid();
-    player.Draw();
-    enemyManager->Draw();
-    bulletManager->DrawBullets();
-    //player.DrawBullets();
-
+    AllocScope scope(ALLOC_SCOPE::RENDER);
+    assets.Upload();
+    window->setView(frame.view);
+    window->clear(sf::Color::Green);
+    spriteBatch.Flush(*window, frame);
+    window->display();
 }
 
+// Lock-free single producer, single consumer hand-off. The writer always has a free slot,
+// and the reader always gets the newest published value
+template <typename T>
+class TripleBuffer
+{
+public:
+    // Writer side
+    T& WriteBuffer() { return slots[back]; }
+
+    void Publish()
+    {
+        int old = middle.exchange(back | FRESH, std::memory_order_acq_rel);
+        back = old & INDEX;
+        middle.notify_all();
+    }
+
+    // Blocks while the last published value hasn't been picked up yet
+    void WaitUntilTaken()
+    {
+        int v = middle.load(std::memory_order_acquire);
+        while (v & FRESH)
+        {
+            middle.wait(v, std::memory_order_acquire);
+            v = middle.load(std::memory_order_acquire);
+        }
+    }
+
+    // Reader side. Blocks until something new is published
+    const T& Acquire()
+    {
+        int v = middle.load(std::memory_order_acquire);
+        while (!(v & FRESH))
+        {
+            middle.wait(v, std::memory_order_acquire);
+            v = middle.load(std::memory_order_acquire);
+        }
+        int old = middle.exchange(front, std::memory_order_acq_rel);
+        front = old & INDEX;
+        middle.notify_all();
+        return slots[front];
+    }
+
+private:
+    static const int INDEX = 3;
+    static const int FRESH = 4;
+
+    T slots[3];
+    int back = 0;
+    int front = 1;
+    std::atomic<int> middle = 2; // Slot index plus FRESH when it holds something the reader hasn't seen
+};
+
+// Runs Present on its own thread so the next frame is simulated while the last one is drawn.
+// The simulation never gets more than one frame ahead of what's on screen
+class RenderPipeline
+{
+public:
+    // Off: simulate and draw one after the other on the main thread, for comparison
+    bool threaded = true;
+
+    void Start()
+    {
+        if (!threaded) return;
+        stopping = false;
+        (void)window->setActive(false); // The context can only be current on one thread
+        renderThread = std::thread(&RenderPipeline::RenderLoop, this);
+    }
+
+    // Call before anything that should count as this frame's simulation. Returns the snapshot to record into
+    RenderSnapshot& BeginFrame()
+    {
+        if (renderThread.joinable()) frames.WaitUntilTaken();
+        simStart = std::chrono::steady_clock::now();
+        return frames.WriteBuffer();
+    }
+
+    void Publish()
+    {
+        auto now = std::chrono::steady_clock::now();
+        Average(simMs, std::chrono::duration<float, std::milli>(now - simStart).count());
+        Average(frameMs, std::chrono::duration<float, std::milli>(now - lastPublish).count());
+        lastPublish = now;
+
+        if (renderThread.joinable()) frames.Publish();
+        else if (!threaded)
+        {
+            Present(frames.WriteBuffer());
+            Average(renderMs, std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - now).count());
+        }
+    }
+
+    // Must be called before the window is closed
+    void Stop()
+    {
+        if (!renderThread.joinable()) return;
+        stopping = true;
+        frames.Publish(); // Wakes the render thread if it's waiting
+        renderThread.join();
+        (void)window->setActive(true);
+    }
+
+    void Report()
+    {
+        std::cout << "[PIPELINE]: " << (threaded ? "threaded" : "serial")
+            << ", sim " << simMs.load() << " ms, render " << renderMs.load() << " ms, frame " << frameMs.load() << " ms\n";
+    }
+
+private:
+    TripleBuffer<RenderSnapshot> frames;
+    std::thread renderThread;
+    std::atomic<bool> stopping = false;
+
+    // Moving averages, render is written by the render thread
+    std::atomic<float> simMs = 0;
+    std::atomic<float> renderMs = 0;
+    std::atomic<float> frameMs = 0;
+    std::chrono::steady_clock::time_point simStart;
+    std::chrono::steady_clock::time_point lastPublish;
+
+    static void Average(std::atomic<float>& avg, float sample)
+    {
+        avg.store(avg.load(std::memory_order_relaxed) * 0.95f + sample * 0.05f, std::memory_order_relaxed);
+    }
+
+    void RenderLoop()
+    {
+        AllocScope scope(ALLOC_SCOPE::RENDER);
+        (void)window->setActive(true);
+        while (true)
+        {
+            const RenderSnapshot& frame = frames.Acquire();
+            if (stopping) break;
+            auto start = std::chrono::steady_clock::now();
+            Present(frame);
+            Average(renderMs, std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count());
+        }
+        (void)window->setActive(false);
+    }
+};
+
+RenderPipeline pipeline;
+
+// Holds the main loop to a steady rate. Sleeps for most of the wait and spins for the last bit, because a
+// sleep can wake up late by up to a scheduler tick. How long to spin for is learned from how late sleeps
+// actually wake up. Also keeps a histogram of frame times (start of one frame to start of the next)
+class FramePacer
+{
+public:
+    int targetFps = 60; // 0 runs as fast as it can, frame times are still recorded
+
+    // Call once at the end of every frame. Returns when the next frame should start
+    void WaitForNextFrame()
+    {
+        auto now = Clock::now();
+        if (targetFps > 0)
+        {
+            auto period = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / targetFps));
+            if (frames == 0) nextStart = now;
+            nextStart += period;
+            if (nextStart <= now)
+            {
+                // Ran over. Start again from now rather than trying to catch up with a burst of short frames
+                missed++;
+                nextStart = now;
+            }
+            else WaitUntil(nextStart);
+            now = Clock::now();
+        }
+
+        if (frames > 0) Record(std::chrono::duration<double, std::micro>(now - frameStart).count());
+        frameStart = now;
+        frames++;
+    }
+
+    void Report()
+    {
+        std::cout << "[FRAMES]: target " << (targetFps > 0 ? std::to_string(targetFps) + " fps" : std::string("unlimited"))
+            << ", " << recorded << " frames, mean " << (recorded > 0 ? totalUs / recorded / 1000 : 0) << " ms"
+            << ", p50 " << Percentile(0.50) << " ms, p95 " << Percentile(0.95) << " ms, p99 " << Percentile(0.99) << " ms"
+            << ", max " << maxUs / 1000 << " ms\n";
+        double waited = sleptUs + spunUs;
+        std::cout << "[FRAMES]: missed deadlines " << missed << " (" << (frames > 0 ? 100.0 * missed / frames : 0) << "%)"
+            << ", waiting " << (totalUs > 0 ? 100 * waited / totalUs : 0) << "% of the time, "
+            << (waited > 0 ? 100 * sleptUs / waited : 0) << "% of that asleep"
+            << ", spin margin " << spinMarginUs / 1000 << " ms, worst oversleep " << worstOversleepUs / 1000 << " ms\n";
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+    static const int BUCKETS = 1000; // 0.1 ms each, anything past 100 ms goes in the last one
+    static constexpr double BUCKET_US = 100;
+    static constexpr double MIN_SPIN_US = 200;
+    static constexpr double MAX_SPIN_US = 4000;
+
+    long long histogram[BUCKETS + 1] = {};
+    long long frames = 0;
+    long long recorded = 0;
+    long long missed = 0;
+    double totalUs = 0;
+    double maxUs = 0;
+    double sleptUs = 0;
+    double spunUs = 0;
+    double spinMarginUs = 1000;
+    double worstOversleepUs = 0;
+    Clock::time_point nextStart;
+    Clock::time_point frameStart;
+
+    void WaitUntil(Clock::time_point deadline)
+    {
+        auto start = Clock::now();
+        auto wakeAt = deadline - std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double, std::micro>(spinMarginUs));
+        if (wakeAt > start)
+        {
+            std::this_thread::sleep_until(wakeAt);
+            auto woke = Clock::now();
+            sleptUs += std::chrono::duration<double, std::micro>(woke - start).count();
+
+            // Spin for a bit more than the latest wakeups seen recently, and slowly give it back when sleeps are on time
+            double oversleep = std::chrono::duration<double, std::micro>(woke - wakeAt).count();
+            worstOversleepUs = std::max(worstOversleepUs, oversleep);
+            spinMarginUs = std::clamp(std::max(spinMarginUs * 0.99, oversleep * 1.25), MIN_SPIN_US, MAX_SPIN_US);
+            start = woke;
+        }
+        while (Clock::now() < deadline) std::this_thread::yield();
+        spunUs += std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+    }
+
+    void Record(double us)
+    {
+        histogram[std::min((int)BUCKETS, (int)(us / BUCKET_US))]++;
+        recorded++;
+        totalUs += us;
+        maxUs = std::max(maxUs, us);
+    }
+
+    // Upper edge of the bucket the p-th frame time falls in, in ms
+    double Percentile(double p)
+    {
+        if (recorded == 0) return 0;
+        long long rank = std::max(1LL, (long long)std::ceil(p * recorded));
+        long long seen = 0;
+        for (int i = 0; i < BUCKETS; i++)
+        {
+            seen += histogram[i];
+            if (seen >= rank) return std::min((i + 1) * BUCKET_US, maxUs) / 1000;
+        }
+        return maxUs / 1000;
+    }
+};
+
+FramePacer framePacer;
+
 
-int main()
+int main(int argc, char** argv)
 {
+    int batchWorlds = 0;
+    int batchTicks = 60 * 60;
+    int batchThreads = (int)std::thread::hardware_concurrency();
+    for (int i = 1; i < argc; i++)
+    {
+        // Fail as soon as a frame allocates after a short warmup
+        if (std::string(argv[i]) == "--alloc-guard") AllocTracker::guardAfterFrames = 120;
+        // Headless; doesn't open a window
+        if (std::string(argv[i]) == "--collision-selftest") return CollisionSelfTest::Run(1234) == 0 ? 0 : 1;
+        // Headless: --batch <worlds> runs that many bot-driven worlds and exits
+        if (std::string(argv[i]) == "--batch" && i + 1 < argc) batchWorlds = std::atoi(argv[++i]);
+        if (std::string(argv[i]) == "--batch-ticks" && i + 1 < argc) batchTicks = std::atoi(argv[++i]);
+        if (std::string(argv[i]) == "--batch-threads" && i + 1 < argc) batchThreads = std::atoi(argv[++i]);
+        if (std::string(argv[i]) == "--procgen" && i + 1 < argc)
+        {
+            proceduralLevel = true;
+            roomStreamer.generator.seed = std::strtoull(argv[++i], nullptr, 10);
+        }
+        // Simulate and draw on one thread, to compare against the pipeline
+        if (std::string(argv[i]) == "--serial-render") pipeline.threaded = false;
+        // Target frame rate, 0 for no limit
+        if (std::string(argv[i]) == "--fps" && i + 1 < argc) framePacer.targetFps = std::max(0, std::atoi(argv[++i]));
+        // grid32/grid64/grid128/grid256/sap/quadtree, instead of picking one automatically
+        if (std::string(argv[i]) == "--broadphase" && i + 1 < argc) broadphaseBackend = argv[++i];
+    }
+
+    if (batchWorlds > 0)
+    {
+        RoomFile file;
+        try { file = RoomParser::ParseFile(LEVEL_FILE); }
+        catch (const std::exception& e) { std::cout << "[ROOMS]: " << e.what() << ", using the default room\n"; }
+        BatchRunner runner;
+        runner.Run(file.rooms, batchWorlds, batchTicks, batchThreads, 1234);
+        return 0;
+    }
     
     Init();
+    pipeline.Start();
 
     while (window->isOpen())
     {
+        AllocTracker::BeginFrame();
+        RenderSnapshot& frame = pipeline.BeginFrame();
         float dt = game_clock.restart().asSeconds();
+        assets.Poll(); // Pack any textures that finished loading
         while (const std::optional event = window->pollEvent())
         {
             if (event->is<sf::Event::Closed>())
             {
+                pipeline.Stop();
                 window->close();
             }
             else if (const auto* keyPressed = event->getIf<sf::Event::KeyPressed>())
             {
                 if (keyPressed->scancode == sf::Keyboard::Scancode::Escape)
+                {
+                    pipeline.Stop();
                     window->close();
+                }
                 if (keyPressed->code == Keybindings::FIRE)
                 {
                     //std::cout << "spacey\n";
-                    player.OnFireButtonPress();
+                    fireQueued = true;
                 }
+                if (keyPressed->code == Keybindings::MEASURE_ROLLBACK) session.MeasureWorstCase();
+                if (keyPressed->code == Keybindings::ALLOC_REPORT) AllocTracker::Report();
+                if (keyPressed->code == Keybindings::PIPELINE_REPORT) pipeline.Report();
+                if (keyPressed->code == Keybindings::FRAME_REPORT) framePacer.Report();
+                if (keyPressed->code == Keybindings::BROADPHASE_REPORT) world->broadphase.Report();
+                if (keyPressed->code == Keybindings::GRID_REPORT) world->PrintDebug();
+                // Switched by the next tick, see World::ApplyToggles. Pressing twice before it cancels out
+                if (keyPressed->code == Keybindings::TOGGLE_HOMING) homingToggleQueued = !homingToggleQueued;
+                if (keyPressed->code == Keybindings::TOGGLE_HIT_POLICY) hitPolicyToggleQueued = !hitPolicyToggleQueued;
             }
         }
         Update(dt);
-        window->clear(sf::Color::Green);
-        Draw();
-        window->display();
+        Draw(frame);
+        pipeline.Publish();
+        AllocTracker::EndFrame();
+        framePacer.WaitForNextFrame();
     }
 
+    framePacer.Report();
     return 0;
 }